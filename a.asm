@@ -1,16 +1,27 @@
 section .text
 
-global get_context_cur, set_context, get_context_par, get_context1
-extern scheduler
+global get_context_cur, set_context, get_context_par, get_context1, get_context_signal
+extern scheduler, context_full_abi
 
-get_context1:
+; Offsets into struct Context, past the 8 general purpose registers.
+%define CTX_MXCSR 8*8
+%define CTX_FPUCW 8*8 + 4
+%define CTX_FLAGS 8*8 + 6
+; sizeof(struct Context), rounded up so the stack stays 16-byte aligned for the call to scheduler.
+%define CTX_SIZE 8*10
+
+; struct Context flags
+%define CONTEXT_HAS_CONTROL 1
+
+; Builds a struct Context for the caller on the stack, then rdi points to it.
+%macro save_caller_context 0
     ; get return address
     push rbp
     mov rbp, rsp ; Set the RBP to the old RSP, saving it
     ; RBP now points to saved, previous RBP
     ; RBP + 8 also equals old RSP
 
-    sub rsp, 0x8*8
+    sub rsp, CTX_SIZE
 
     mov r8, [rbp+0x8] ; return address
     mov [rsp + 8 * 0], r8 ; set return address
@@ -33,13 +44,36 @@ get_context1:
     mov [rsp + 8*6], r14
     mov [rsp + 8*7], r15
 
+    mov word [rsp + CTX_FLAGS], 0
+
     ; Load address of struct to rdi
     lea rdi, [rsp]
+%endmacro
+
+; Cooperative switch. With the full-ABI flavour, also saves the FPU control state. Vector registers are all
+; caller-saved, so a call doesn't need to keep them.
+get_context1:
+    save_caller_context
 
+    cmp dword [rel context_full_abi], 0
+    je .switch
+    stmxcsr [rdi + CTX_MXCSR]
+    fnstcw [rdi + CTX_FPUCW]
+    or word [rdi + CTX_FLAGS], CONTEXT_HAS_CONTROL
+
+.switch:
 ;    pop rbp
     call scheduler
     mov rsp, rbp
 
+; Pre-emption from the signal handler. The kernel already saved the whole FPU and vector state in the signal frame,
+; and restores it when the handler returns, so only the general purpose registers are needed. The handler itself
+; starts with the FPU in its initial state, so the next task doesn't inherit the pre-empted one's vector registers.
+get_context_signal:
+    save_caller_context
+    call scheduler
+    mov rsp, rbp
+
 
 
 get_context_cur:
@@ -86,9 +120,15 @@ set_context:
     mov r14, [rdi + 8 * 6]
     mov r15, [rdi + 8 * 7]
 
+    test word [rdi + CTX_FLAGS], CONTEXT_HAS_CONTROL
+    jz .jump
+    ldmxcsr [rdi + CTX_MXCSR]
+    fldcw [rdi + CTX_FPUCW]
+
+.jump:
     mov r8, [rdi]
     push r8
     xor eax, eax
     ret
 
-
+section .note.GNU-stack noalloc noexec nowrite progbits
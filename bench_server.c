@@ -0,0 +1,328 @@
+#include <stdio.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "runtime.h"
+
+/**
+ * End-to-end benchmark for the runtime: a one-task-per-connection echo server and a minimal HTTP/1.1 server,
+ * driven over 127.0.0.1 by a load generator that runs as tasks in the same runtime.
+ *
+ * Each round opens `connections` client connections, waits until all of them are connected, then releases them at
+ * once. Every client does `requests` request/response round trips, timing each one. The round reports requests/s
+ * over the request phase, plus p50/p99/p999 latency.
+ *
+ * Every connection takes two tasks, and the build gives NUM_TASKS room for 10000 connections.
+ *
+ * Usage: bench_server [echo|http|all] [requests per connection] [connections...]
+ * Defaults to: all 50 10 100 1000 10000. Connection counts that don't fit in RLIMIT_NOFILE or NUM_TASKS are skipped.
+ */
+
+enum Protocol {
+    ECHO, HTTP
+};
+
+const char *protocol_names[] = {"echo", "http"};
+
+#define ECHO_MESSAGE_SIZE 64
+
+const char http_request[] = "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+const char http_response[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 13\r\n\r\nHello, world!";
+
+// Everything shared between the tasks of the round that is running.
+struct Round {
+    enum Protocol protocol;
+    int connections;
+    int requests;
+
+    int listen_fd;
+    struct sockaddr_in addr;
+
+    // The task running the round, woken when all clients are connected and when all of them finished.
+    int coordinator;
+    int *client_ids;
+
+    // Only changed with atomic increments: a pre-emption in the middle of a plain ++ loses updates.
+    int connected;
+    int finished;
+    // Clients park on this until the coordinator starts the request phase.
+    int go;
+
+    // Latency of every request in microseconds, `requests` per client.
+    long *latencies;
+} bench;
+
+static void set_nodelay(int fd) {
+    int one = 1;
+    enter_critical();
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    exit_critical();
+}
+
+static void close_fd(int fd) {
+    enter_critical();
+    close(fd);
+    exit_critical();
+}
+
+// Reads until `len` bytes have arrived. Returns false on EOF or error.
+static bool read_exactly(int fd, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = task_read(fd, buf + got, len - got);
+        if (n <= 0) return false;
+        got += n;
+    }
+    return true;
+}
+
+// Reads an HTTP message head (and whatever follows it) into buf, until the blank line ending it has arrived.
+// Returns the number of bytes read, with *head_len set to the length of the head including the blank line.
+static ssize_t read_http_head(int fd, char *buf, size_t size, size_t *head_len) {
+    size_t got = 0;
+    for (;;) {
+        ssize_t n = task_read(fd, buf + got, size - 1 - got);
+        if (n <= 0) return -1;
+        got += n;
+        buf[got] = 0;
+        char *end = strstr(buf, "\r\n\r\n");
+        if (end != NULL) {
+            *head_len = end + 4 - buf;
+            return (ssize_t) got;
+        }
+        if (got == size - 1) return -1;
+    }
+}
+
+void echo_connection(void *arg) {
+    int fd = (int) (intptr_t) arg;
+    char buf[512];
+    for (;;) {
+        ssize_t n = task_read(fd, buf, sizeof buf);
+        if (n <= 0 || task_write(fd, buf, n) != n) break;
+    }
+    close_fd(fd);
+}
+
+void http_connection(void *arg) {
+    int fd = (int) (intptr_t) arg;
+    char buf[1024];
+    size_t head_len;
+    ssize_t got;
+    while ((got = read_http_head(fd, buf, sizeof buf, &head_len)) > 0) {
+        // Clients wait for each response before sending the next request, so nothing follows the head.
+        if ((size_t) got != head_len || strncmp(buf, "GET ", 4) != 0) break;
+        if (task_write(fd, http_response, sizeof http_response - 1) < 0) break;
+    }
+    close_fd(fd);
+}
+
+void acceptor(void *arg) {
+    void (*handler)(void *) = bench.protocol == ECHO ? echo_connection : http_connection;
+    for (int i = 0; i < bench.connections; i++) {
+        int fd = task_accept(bench.listen_fd);
+        if (fd < 0) {
+            perror("Accept failed");
+            exit(1);
+        }
+        set_nodelay(fd);
+        new_task_arg(handler, (void *) (intptr_t) fd);
+    }
+}
+
+static bool echo_round_trip(int fd, char *buf) {
+    char message[ECHO_MESSAGE_SIZE];
+    memset(message, 'x', sizeof message);
+    return task_write(fd, message, sizeof message) == sizeof message && read_exactly(fd, buf, sizeof message);
+}
+
+static bool http_round_trip(int fd, char *buf, size_t size) {
+    if (task_write(fd, http_request, sizeof http_request - 1) < 0) return false;
+    size_t head_len;
+    ssize_t got = read_http_head(fd, buf, size, &head_len);
+    if (got < 0 || strncmp(buf, "HTTP/1.1 200", 12) != 0) return false;
+
+    char *length = strstr(buf, "Content-Length:");
+    if (length == NULL || length > buf + head_len) return false;
+    size_t total = head_len + strtoul(length + 15, NULL, 10);
+    if (total >= size) return false;
+    return (size_t) got >= total || read_exactly(fd, buf + got, total - got);
+}
+
+void client(void *arg) {
+    int index = (int) (intptr_t) arg;
+    char buf[1024];
+
+    enter_critical();
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    exit_critical();
+    if (fd < 0 || task_connect(fd, (struct sockaddr *) &bench.addr, sizeof bench.addr) != 0) {
+        perror("Connect failed");
+        exit(1);
+    }
+    set_nodelay(fd);
+
+    if (__atomic_add_fetch(&bench.connected, 1, __ATOMIC_SEQ_CST) == bench.connections) {
+        task_wake(bench.coordinator);
+    }
+    task_wait_counter(&bench.go, 1);
+
+    long *latencies = bench.latencies + (long) index * bench.requests;
+    for (int i = 0; i < bench.requests; i++) {
+        long start = my_clock();
+        bool ok = bench.protocol == ECHO ? echo_round_trip(fd, buf) : http_round_trip(fd, buf, sizeof buf);
+        if (!ok) {
+            fprintf(stderr, "Client %d: bad response\n", index);
+            exit(1);
+        }
+        latencies[i] = my_clock() - start;
+    }
+    close_fd(fd);
+
+    if (__atomic_add_fetch(&bench.finished, 1, __ATOMIC_SEQ_CST) == bench.connections) {
+        task_wake(bench.coordinator);
+    }
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+static long percentile(const long *sorted, long count, double p) {
+    long index = (long) (p * (double) count + 0.5) - 1;
+    if (index < 0) index = 0;
+    if (index >= count) index = count - 1;
+    return sorted[index];
+}
+
+static void open_listener() {
+    enter_critical();
+    bench.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    memset(&bench.addr, 0, sizeof bench.addr);
+    bench.addr.sin_family = AF_INET;
+    bench.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bench.addr.sin_port = 0;
+    socklen_t len = sizeof bench.addr;
+    if (bench.listen_fd < 0 ||
+        bind(bench.listen_fd, (struct sockaddr *) &bench.addr, sizeof bench.addr) != 0 ||
+        listen(bench.listen_fd, SOMAXCONN) != 0 ||
+        getsockname(bench.listen_fd, (struct sockaddr *) &bench.addr, &len) != 0) {
+        perror("Listen failed");
+        exit(1);
+    }
+    exit_critical();
+}
+
+void run_round(enum Protocol protocol, int connections, int requests) {
+    bench.protocol = protocol;
+    bench.connections = connections;
+    bench.requests = requests;
+    bench.coordinator = sch.curtask;
+    bench.connected = 0;
+    bench.finished = 0;
+    bench.go = 0;
+
+    enter_critical();
+    bench.latencies = malloc(sizeof(long) * connections * requests);
+    bench.client_ids = malloc(sizeof(int) * connections);
+    exit_critical();
+    open_listener();
+
+    new_task_arg(acceptor, NULL);
+    for (int i = 0; i < connections; i++) {
+        bench.client_ids[i] = new_task_arg(client, (void *) (intptr_t) i);
+    }
+    task_wait_counter(&bench.connected, connections);
+
+    long start = my_clock();
+    __atomic_store_n(&bench.go, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < connections; i++) {
+        task_wake(bench.client_ids[i]);
+    }
+    task_wait_counter(&bench.finished, connections);
+    long elapsed = my_clock() - start;
+    close_fd(bench.listen_fd);
+
+    long count = (long) connections * requests;
+    enter_critical();
+    qsort(bench.latencies, count, sizeof(long), compare_long);
+    printf("%-4s connections=%-6d requests=%-8ld rps=%-10.0f p50=%ldus p99=%ldus p999=%ldus\n",
+           protocol_names[protocol], connections, count, (double) count / ((double) elapsed / 1e6),
+           percentile(bench.latencies, count, 0.50), percentile(bench.latencies, count, 0.99),
+           percentile(bench.latencies, count, 0.999));
+    fflush(stdout);
+    free(bench.latencies);
+    free(bench.client_ids);
+    exit_critical();
+}
+
+struct Config {
+    bool protocols[2];
+    int requests;
+    int connections[16];
+    int rounds;
+} config;
+
+void bench_task() {
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+
+    for (int p = ECHO; p <= HTTP; p++) {
+        if (!config.protocols[p]) continue;
+        for (int i = 0; i < config.rounds; i++) {
+            int connections = config.connections[i];
+            // Both ends of every connection live in this process. Two task slots are taken by idle and this task.
+            if ((rlim_t) connections * 2 + 16 > limit.rlim_cur || connections * 2 + 3 > NUM_TASKS) {
+                printf("%-4s connections=%-6d skipped: needs %d file descriptors and task slots\n",
+                       protocol_names[p], connections, connections * 2 + 16);
+                continue;
+            }
+            run_round(p, connections, config.requests);
+        }
+    }
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    int arg = 1;
+    const char *mode = argc > arg ? argv[arg++] : "all";
+    config.protocols[ECHO] = strcmp(mode, "echo") == 0 || strcmp(mode, "all") == 0;
+    config.protocols[HTTP] = strcmp(mode, "http") == 0 || strcmp(mode, "all") == 0;
+    config.requests = argc > arg ? atoi(argv[arg++]) : 50;
+    for (; arg < argc && config.rounds < 16; arg++) {
+        config.connections[config.rounds++] = atoi(argv[arg]);
+    }
+    if (config.rounds == 0) {
+        int defaults[] = {10, 100, 1000, 10000};
+        memcpy(config.connections, defaults, sizeof defaults);
+        config.rounds = 4;
+    }
+    if ((!config.protocols[ECHO] && !config.protocols[HTTP]) || config.requests <= 0) {
+        fprintf(stderr, "Usage: %s [echo|http|all] [requests per connection] [connections...]\n", argv[0]);
+        return 1;
+    }
+
+    // Connections need two file descriptors each, so use as many as we're allowed to.
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    signal(SIGPIPE, SIG_IGN);
+
+    runtime_init();
+    new_task(&bench_task);
+    runtime_run();
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <cpuid.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "runtime.h"
+
+/**
+ * Cost of a cooperative switch (task_yield() into the scheduler and back out to the other task) for each context
+ * flavour. Two tasks yield to each other `switches` times:
+ *  minimal: CONTEXT_MINIMAL, only the callee-saved registers.
+ *  full:    CONTEXT_FULL_ABI, also MXCSR and the x87 control word.
+ * Afterwards, checks that full-ABI tasks keep their own MXCSR and x87 control word across a yield, without seeing
+ * another task's, and that a task pre-empted with a ymm register in use gets it back, without the next task finding
+ * the AVX state still in use.
+ *
+ * Usage: bench_switch [switches]
+ */
+
+enum Mode {
+    MINIMAL, FULL
+};
+
+const char *mode_names[] = {"minimal", "full"};
+
+struct Run {
+    enum Mode mode;
+    long switches;
+    int coordinator;
+    // Tasks of the current run that are done. Changed atomically, since the checks pre-empt tasks.
+    int finished;
+} run;
+
+static void finish() {
+    __atomic_add_fetch(&run.finished, 1, __ATOMIC_SEQ_CST);
+    task_wake(run.coordinator);
+}
+
+void ping_pong(void *arg) {
+    for (long i = 0; i < run.switches; i++) task_yield();
+    finish();
+}
+
+static void run_mode(enum Mode mode, long switches) {
+    run.mode = mode;
+    run.switches = switches;
+    run.coordinator = sch.curtask;
+    run.finished = 0;
+
+    set_context_flavour(mode == MINIMAL ? CONTEXT_MINIMAL : CONTEXT_FULL_ABI);
+    long start = my_clock();
+    new_task_arg(ping_pong, NULL);
+    new_task_arg(ping_pong, NULL);
+    task_wait_counter(&run.finished, 2);
+    long elapsed = my_clock() - start;
+    set_context_flavour(CONTEXT_MINIMAL);
+
+    printf("%-12s switches=%-10ld ns/switch=%.1f\n", mode_names[mode], switches * 2,
+           (double) elapsed * 1000.0 / (double) (switches * 2));
+    fflush(stdout);
+}
+
+// A full-ABI task changes its control state and yields, a second one checks that it still has the initial state,
+// changes it differently and yields back, then the first checks that it got its own state back, and so does the second.
+struct Check {
+    int step;
+    bool control_kept;
+    bool control_isolated;
+    // Set once the second vector task ran, i.e. the first one was pre-empted.
+    int ran;
+    bool vector_kept;
+    bool vector_reset;
+} check;
+
+// Round up and flush to zero, and round up with 53-bit precision.
+#define FIRST_MXCSR 0xdf80
+#define FIRST_FPUCW 0x0a7f
+// Round toward zero.
+#define SECOND_MXCSR 0x7f80
+#define SECOND_FPUCW 0x0f7f
+// What new full-ABI tasks start with.
+#define INITIAL_MXCSR 0x1f80
+#define INITIAL_FPUCW 0x037f
+
+static void set_control(uint32_t mxcsr, uint16_t fpucw) {
+    __asm__ volatile("ldmxcsr %0\n\tfldcw %1" :: "m"(mxcsr), "m"(fpucw));
+}
+
+static bool control_is(uint32_t mxcsr, uint16_t fpucw) {
+    uint32_t current_mxcsr;
+    uint16_t current_fpucw;
+    __asm__ volatile("stmxcsr %0\n\tfnstcw %1" : "=m"(current_mxcsr), "=m"(current_fpucw));
+    return current_mxcsr == mxcsr && current_fpucw == fpucw;
+}
+
+static void wait_step(int step) {
+    while (check.step < step) task_yield();
+}
+
+void control_first(void *arg) {
+    set_control(FIRST_MXCSR, FIRST_FPUCW);
+    check.step = 1;
+    wait_step(2);
+    check.control_kept = control_is(FIRST_MXCSR, FIRST_FPUCW);
+    check.step = 3;
+}
+
+void control_second(void *arg) {
+    wait_step(1);
+    check.control_isolated = control_is(INITIAL_MXCSR, INITIAL_FPUCW);
+    set_control(SECOND_MXCSR, SECOND_FPUCW);
+    check.step = 2;
+    wait_step(3);
+    check.control_kept = check.control_kept && control_is(SECOND_MXCSR, SECOND_FPUCW);
+    finish();
+}
+
+// AVX, and XGETBV with ECX=1 to read which state components are in use.
+static bool has_xinuse() {
+    unsigned eax, ebx, ecx, edx;
+    __cpuid_count(0xd, 1, eax, ebx, ecx, edx);
+    return __builtin_cpu_supports("avx") && (eax & 4);
+}
+
+// ymm15 only stays live within the asm statement, which spins until the other task ran.
+void vector_first(void *arg) {
+    uint64_t high;
+    __asm__ volatile("vpcmpeqd %%xmm15, %%xmm15, %%xmm15\n\t"
+                     "vinsertf128 $1, %%xmm15, %%ymm15, %%ymm15\n"
+                     "1:\tpause\n\t"
+                     "cmpl $0, %1\n\t"
+                     "je 1b\n\t"
+                     "vextractf128 $1, %%ymm15, %%xmm15\n\t"
+                     "vmovq %%xmm15, %0\n\t"
+                     "vzeroupper"
+                     : "=r"(high) : "m"(check.ran) : "xmm15");
+    check.vector_kept = high == UINT64_MAX;
+    finish();
+}
+
+void vector_second(void *arg) {
+    unsigned in_use, high;
+    __asm__ volatile("xgetbv" : "=a"(in_use), "=d"(high) : "c"(1));
+    check.vector_reset = !(in_use & 4);
+    __atomic_store_n(&check.ran, 1, __ATOMIC_SEQ_CST);
+}
+
+static void run_check() {
+    run.coordinator = sch.curtask;
+    run.finished = 0;
+    set_context_flavour(CONTEXT_FULL_ABI);
+    new_task_arg(control_first, NULL);
+    new_task_arg(control_second, NULL);
+    task_wait_counter(&run.finished, 1);
+    set_context_flavour(CONTEXT_MINIMAL);
+    printf("full-ABI tasks keep their MXCSR and x87 control word: %s, and don't see another task's: %s\n",
+           check.control_kept ? "yes" : "NO", check.control_isolated ? "yes" : "NO");
+    if (!check.control_kept || !check.control_isolated) exit(1);
+
+    if (!has_xinuse()) {
+        printf("pre-empted tasks' vector state: skipped, no AVX or XINUSE\n");
+        return;
+    }
+    run.finished = 0;
+    new_task_arg(vector_first, NULL);
+    new_task_arg(vector_second, NULL);
+    task_wait_counter(&run.finished, 1);
+    printf("pre-empted tasks keep their vector registers: %s, and don't leave them in use: %s\n",
+           check.vector_kept ? "yes" : "NO", check.vector_reset ? "yes" : "NO");
+    if (!check.vector_kept || !check.vector_reset) exit(1);
+}
+
+long config_switches;
+
+void bench_task() {
+    run_mode(MINIMAL, config_switches);
+    run_mode(FULL, config_switches);
+    run_check();
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    config_switches = argc > 1 ? atol(argv[1]) : 1000000;
+    if (config_switches <= 0) {
+        fprintf(stderr, "Usage: %s [switches]\n", argv[0]);
+        return 1;
+    }
+
+    runtime_init();
+    new_task(&bench_task);
+    runtime_run();
+}
@@ -4,134 +4,11 @@
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
-#include <glib.h>
+#include <math.h>
+#include <time.h>
 #include <assert.h>
 
-#pragma GCC diagnostic pop
-typedef double *GCDouble;
-typedef char *GCString;
-typedef void *GCPointer;
-typedef int *GCInt;
-typedef struct {
-    void **arr;
-    size_t len;
-} ArrayType;
-struct KnownObjects {
-    void *buf[10000];
-    int index;
-} known;
-
-struct StackMap {
-    int index;
-
-    void (*fn_ptr)(void *, GHashTable *);
-};
-
-extern struct StackMap STACK_MAP[];
-
-void *gc_malloc(size_t size) {
-    void *ptr;
-    ptr = malloc(size);
-    memset(ptr, 0, size);
-    printf("Allocating %p\n", ptr);
-    known.buf[known.index++] = ptr;
-}
-
-void *gc_free(void *ptr, int index_hint) {
-    if (index_hint != (-1)) {
-        assert(known.buf[index_hint] == ptr);
-        printf("Freeing %p\n", ptr);
-        free(ptr);
-        known.buf[index_hint] = 0;
-    } else {
-        for (int i = 0; i < known.index; i++) {
-            if (known.buf[i] == ptr) {
-                known.buf[i] = 0;
-                return 0;
-            }
-        }
-
-        assert(0 && "Trying to free a non-gc owned pointer");
-    }
-}
-
-void gc_mark_plain(const void *obj, GHashTable *table) {
-    g_hash_table_add(table, (gpointer) obj);
-}
-
-void gc_mark_ArrayType1(ArrayType *arr, void (*fnptr)(void *, GHashTable *), GHashTable *table) {
-    if (arr != 0) {
-        if (arr->arr != 0) {
-            gc_mark_plain((const void *) arr->arr, table);
-            for (int i = 0; i < arr->len; i++) {
-                gc_mark_plain(arr->arr[i], table);
-                fnptr(arr->arr[i], table);
-            }
-
-        }
-    }
-}
-
-void gc_mark_ArrayType(ArrayType *arr, GHashTable *table) {
-    gc_mark_ArrayType1(arr, (void (*)(void *, GHashTable *)) gc_mark_plain, table);
-}
-
-void gc_mark_GCString(GCString *str, GHashTable *table) {
-    gc_mark_plain((void *) (*str), table);
-}
-
-void gc_find_unused(GHashTable *marked) {
-    int deadcount = 0;
-    for (int i = 0; i < known.index; i++) {
-        gconstpointer to_check = (gconstpointer) known.buf[i];
-        if (to_check == 0) {
-            continue;
-        }
-        if (g_hash_table_contains(marked, to_check)) {
-        } else {
-            gc_free(to_check, i);
-            deadcount++;
-        }
-    }
-
-    int livecount = 0;
-    for (int i = 0; i < known.index; i++) {
-        if (known.buf[i] != 0) {
-            livecount++;
-        }
-    }
-
-    printf("Dead count: %d; Livecount: %d\n", deadcount, livecount);
-}
-
-void *g_stack_frames[1000];
-size_t g_sf_index = 0;
-
-void gc_push_stack_frame(void *ptr) {
-    g_stack_frames[g_sf_index++] = ptr;
-}
-
-void gc_pop_stack_frame() {
-    g_stack_frames[g_sf_index] = 0;
-    g_sf_index--;
-}
-
-void *gc_peek_stack_frame(size_t index) {
-    return g_stack_frames[index];
-}
-
-void gc_run() {
-    GHashTable *table = g_hash_table_new(g_direct_hash, g_direct_equal);
-    for (ssize_t i = g_sf_index - 1; i >= 0; i--) {
-        void *cur_stack = gc_peek_stack_frame(i);
-        int stack_id = *((int *) cur_stack);
-        void (*ptr)(void *, GHashTable *) = STACK_MAP[stack_id].fn_ptr;
-        ptr(cur_stack, table);
-    }
-
-    gc_find_unused(table);
-    g_hash_table_destroy(table);
-}
+#include "gc_runtime.h"
 
 struct Nested1 {
     ArrayType arr;
@@ -140,164 +17,122 @@ struct Nested1 {
 
 struct ArrOfNested {
     ArrayType arr;
-
-    void (*fnptr)(void *, GHashTable *);
+    const struct GCType *element;
 };
 
-void gc_mark_Nested1(struct Nested1 *stc, GHashTable *table);
+extern const struct GCType gc_type_Nested1;
 
-void gc_mark_ArrOfNested(struct ArrOfNested *arr, GHashTable *table) {
-    if ((arr != 0) && (arr->fnptr != 0)) {
-        gc_mark_ArrayType1(&arr->arr, arr->fnptr, table);
+void gc_mark_ArrOfNested(struct ArrOfNested *arr, struct MarkState *state) {
+    if ((arr != 0) && (arr->element != 0)) {
+        gc_mark_ArrayType_typed(&arr->arr, arr->element, state);
     }
 }
 
-void gc_mark_Nested1(struct Nested1 *stc, GHashTable *table);
+const struct GCType gc_type_ArrOfNested = {.size = sizeof(struct ArrOfNested),
+                                           .mark = (void (*)(void *, struct MarkState *)) gc_mark_ArrOfNested};
+
+extern const struct GCType gc_type_Nested1;
 
 struct StackFrame_alloc_string_arr;
 
-void gc_mark_StackFrame_alloc_string_arr(struct StackFrame_alloc_string_arr *stc, GHashTable *table);
+extern const struct GCType gc_type_StackFrame_alloc_string_arr;
 
 struct StackFrame_alloc_nested;
 
-void gc_mark_StackFrame_alloc_nested(struct StackFrame_alloc_nested *stc, GHashTable *table);
+extern const struct GCType gc_type_StackFrame_alloc_nested;
 
 struct StackFrame_alloc_nested_array;
 
-void gc_mark_StackFrame_alloc_nested_array(struct StackFrame_alloc_nested_array *stc, GHashTable *table);
-
-struct StackFrame_moving_delete;
-
-void gc_mark_StackFrame_moving_delete(struct StackFrame_moving_delete *stc, GHashTable *table);
-
-struct StackFrame_array_push;
-
-void gc_mark_StackFrame_array_push(struct StackFrame_array_push *stc, GHashTable *table);
-
-struct StackFrame_alt_fun2;
-
-void gc_mark_StackFrame_alt_fun2(struct StackFrame_alt_fun2 *stc, GHashTable *table);
+extern const struct GCType gc_type_StackFrame_alloc_nested_array;
 
 struct StackFrame_alt_fun1;
 
-void gc_mark_StackFrame_alt_fun1(struct StackFrame_alt_fun1 *stc, GHashTable *table);
+extern const struct GCType gc_type_StackFrame_alt_fun1;
 
 struct StackFrame_main;
 
-void gc_mark_StackFrame_main(struct StackFrame_main *stc, GHashTable *table);
+extern const struct GCType gc_type_StackFrame_main;
 
-void gc_mark_Nested1(struct Nested1 *stc, GHashTable *table) {
-    if (stc != NULL) {
-        gc_mark_ArrayType(&stc->arr, table);
-        gc_mark_GCString(&stc->identifier, table);
-    }
-}
+static const struct GCField gc_pointers_Nested1[] = {{offsetof(struct Nested1, identifier), NULL}};
+
+static const struct GCField gc_arrays_Nested1[] = {{offsetof(struct Nested1, arr), NULL}};
+
+const struct GCType gc_type_Nested1 = {.size = sizeof(struct Nested1),
+                                       .pointer_count = 1,
+                                       .pointers = gc_pointers_Nested1,
+                                       .array_count = 1,
+                                       .arrays = gc_arrays_Nested1};
 
 struct StackFrame_alloc_string_arr {
     int id;
     ArrayType arr;
 };
 
-void gc_mark_StackFrame_alloc_string_arr(struct StackFrame_alloc_string_arr *stc, GHashTable *table) {
-    if (stc != NULL) {
-        gc_mark_ArrayType(&stc->arr, table);
-    }
-}
+static const struct GCField gc_arrays_StackFrame_alloc_string_arr[] = {{offsetof(struct StackFrame_alloc_string_arr, arr), NULL}};
+
+const struct GCType gc_type_StackFrame_alloc_string_arr = {.size = sizeof(struct StackFrame_alloc_string_arr),
+                                                           .array_count = 1,
+                                                           .arrays = gc_arrays_StackFrame_alloc_string_arr};
 
 struct StackFrame_alloc_nested {
     int id;
     struct Nested1 *ret;
 };
 
-void gc_mark_StackFrame_alloc_nested(struct StackFrame_alloc_nested *stc, GHashTable *table) {
-    if (stc != NULL) {
-        {
-            gc_mark_Nested1(stc->ret, table);
-            gc_mark_plain(stc->ret, table);
-        }
-    }
-}
+static const struct GCField gc_pointers_StackFrame_alloc_nested[] = {{offsetof(struct StackFrame_alloc_nested, ret), &gc_type_Nested1}};
+
+const struct GCType gc_type_StackFrame_alloc_nested = {.size = sizeof(struct StackFrame_alloc_nested),
+                                                       .pointer_count = 1,
+                                                       .pointers = gc_pointers_StackFrame_alloc_nested};
 
 struct StackFrame_alloc_nested_array {
     int id;
     struct ArrOfNested arr;
 };
 
-void gc_mark_StackFrame_alloc_nested_array(struct StackFrame_alloc_nested_array *stc, GHashTable *table) {
-    if (stc != NULL) {
-        gc_mark_ArrOfNested(&stc->arr, table);
-    }
-}
-
-struct StackFrame_moving_delete {
-    int id;
-};
-
-void gc_mark_StackFrame_moving_delete(struct StackFrame_moving_delete *stc, GHashTable *table) {
-    if (stc != NULL) {
-    }
-}
-
-struct StackFrame_array_push {
-    int id;
-};
+static const struct GCField gc_structs_StackFrame_alloc_nested_array[] = {{offsetof(struct StackFrame_alloc_nested_array, arr), &gc_type_ArrOfNested}};
 
-void gc_mark_StackFrame_array_push(struct StackFrame_array_push *stc, GHashTable *table) {
-    if (stc != NULL) {
-    }
-}
-
-struct StackFrame_alt_fun2 {
-    int id;
-    struct Nested1 *nested;
-};
-
-void gc_mark_StackFrame_alt_fun2(struct StackFrame_alt_fun2 *stc, GHashTable *table) {
-    if (stc != NULL) {
-        {
-            gc_mark_Nested1(stc->nested, table);
-            gc_mark_plain(stc->nested, table);
-        }
-    }
-}
+const struct GCType gc_type_StackFrame_alloc_nested_array = {.size = sizeof(struct StackFrame_alloc_nested_array),
+                                                             .struct_count = 1,
+                                                             .structs = gc_structs_StackFrame_alloc_nested_array};
 
 struct StackFrame_alt_fun1 {
     int id;
     ArrayType arr;
-    struct Nested1 *nested;
 };
 
-void gc_mark_StackFrame_alt_fun1(struct StackFrame_alt_fun1 *stc, GHashTable *table) {
-    if (stc != NULL) {
-        gc_mark_ArrayType(&stc->arr, table);
-        {
-            gc_mark_Nested1(stc->nested, table);
-            gc_mark_plain(stc->nested, table);
-        }
-    }
-}
+static const struct GCField gc_arrays_StackFrame_alt_fun1[] = {{offsetof(struct StackFrame_alt_fun1, arr), NULL}};
+
+const struct GCType gc_type_StackFrame_alt_fun1 = {.size = sizeof(struct StackFrame_alt_fun1),
+                                                   .array_count = 1,
+                                                   .arrays = gc_arrays_StackFrame_alt_fun1};
 
 struct StackFrame_main {
     int id;
     ArrayType main_array;
     GCString third;
-    GCString fourth;
     struct ArrOfNested nested;
-    struct Nested1 *ptr;
 };
 
-void gc_mark_StackFrame_main(struct StackFrame_main *stc, GHashTable *table) {
-    if (stc != NULL) {
-        gc_mark_ArrayType(&stc->main_array, table);
-        gc_mark_GCString(&stc->third, table);
-        gc_mark_GCString(&stc->fourth, table);
-        gc_mark_ArrOfNested(&stc->nested, table);
-        {
-            gc_mark_Nested1(stc->ptr, table);
-            gc_mark_plain(stc->ptr, table);
-        }
-    }
-}
+static const struct GCField gc_pointers_StackFrame_main[] = {{offsetof(struct StackFrame_main, third), NULL}};
+
+static const struct GCField gc_arrays_StackFrame_main[] = {{offsetof(struct StackFrame_main, main_array), NULL}};
+
+static const struct GCField gc_structs_StackFrame_main[] = {{offsetof(struct StackFrame_main, nested), &gc_type_ArrOfNested}};
+
+const struct GCType gc_type_StackFrame_main = {.size = sizeof(struct StackFrame_main),
+                                               .pointer_count = 1,
+                                               .pointers = gc_pointers_StackFrame_main,
+                                               .array_count = 1,
+                                               .arrays = gc_arrays_StackFrame_main,
+                                               .struct_count = 1,
+                                               .structs = gc_structs_StackFrame_main};
+
+static const struct GCSite gc_sites[] = {{"gc_string1", "gc.c", 44, "GCString"},
+                                         {"alloc_string_arr", "gc.c", 53, "ArrayType"},
+                                         {"alloc_string_arr", "gc.c", 57, "GCString"},
+                                         {"alloc_nested", "gc.c", 67, "Nested1"},
+                                         {"alloc_nested_array", "gc.c", 78, "ArrayType"}};
 
 const int END_CODE_HERE;
 
@@ -306,6 +141,7 @@ GCString gc_string(size_t length) {
 }
 
 GCString gc_string1(const char *source) {
+    gc_site = &gc_sites[0];
     GCString alloc = gc_string(strlen(source) + 1);
     strcpy(alloc, source);
     return alloc;
@@ -317,15 +153,17 @@ ArrayType alloc_string_arr(size_t length) {
     stack_frame.id = 0;
     gc_push_stack_frame((void *) (&stack_frame));
     stack_frame.arr.len = length;
+    stack_frame.arr.capacity = length;
+    gc_site = &gc_sites[1];
     stack_frame.arr.arr = gc_malloc(length * (sizeof(void *)));
     for (int i = 0; i < length; i++) {
         long rand_num = random();
         long strlen = floor(log10((double) rand_num)) + 1;
+        gc_site = &gc_sites[2];
         stack_frame.arr.arr[i] = gc_string(strlen);
         snprintf(stack_frame.arr.arr[i], strlen, "%ld", rand_num);
     }
 
-    gc_run();
     printf("%s\n", stack_frame.arr.arr[0]);
     {
         gc_pop_stack_frame();
@@ -339,10 +177,12 @@ struct Nested1 *alloc_nested(int arr_len, const char *identifier) {
     memset(&stack_frame, 0, sizeof(stack_frame));
     stack_frame.id = 1;
     gc_push_stack_frame((void *) (&stack_frame));
+    gc_site = &gc_sites[3];
     stack_frame.ret = gc_malloc(sizeof(struct Nested1));
     stack_frame.ret->arr = alloc_string_arr(arr_len);
+    gc_write_barrier_typed(stack_frame.ret, &gc_type_Nested1);
     stack_frame.ret->identifier = gc_string1(identifier);
-    gc_run();
+    gc_write_barrier_typed(stack_frame.ret, &gc_type_Nested1);
     {
         gc_pop_stack_frame();
         return stack_frame.ret;
@@ -355,8 +195,10 @@ struct ArrOfNested alloc_nested_array() {
     memset(&stack_frame, 0, sizeof(stack_frame));
     stack_frame.id = 2;
     gc_push_stack_frame((void *) (&stack_frame));
-    stack_frame.arr.fnptr = gc_mark_Nested1;
+    stack_frame.arr.element = &gc_type_Nested1;
     stack_frame.arr.arr.len = 100;
+    stack_frame.arr.arr.capacity = 100;
+    gc_site = &gc_sites[4];
     stack_frame.arr.arr.arr = gc_malloc(stack_frame.arr.arr.len * (sizeof(void *)));
     for (int i = 0; i < stack_frame.arr.arr.len; i++) {
         stack_frame.arr.arr.arr[i] = alloc_nested(19, "hello world");
@@ -370,57 +212,37 @@ struct ArrOfNested alloc_nested_array() {
 }
 
 void moving_delete(ArrayType *arr, size_t index) {
-    struct StackFrame_moving_delete stack_frame;
-    memset(&stack_frame, 0, sizeof(stack_frame));
-    stack_frame.id = 3;
-    gc_push_stack_frame((void *) (&stack_frame));
     assert(index < arr->len);
-    for (size_t i = index; i < (arr->len - 1); i++) {
-        arr->arr[i] = arr->arr[i + 1];
-    }
-
-    arr->len--;
-    gc_pop_stack_frame();
+    gc_array_splice(arr, index, 1, 0, 0);
 }
 
 void array_push(ArrayType *arr, void *elem) {
-    struct StackFrame_array_push stack_frame;
-    memset(&stack_frame, 0, sizeof(stack_frame));
-    stack_frame.id = 4;
-    gc_push_stack_frame((void *) (&stack_frame));
-    arr->arr[arr->len++] = elem;
-    gc_pop_stack_frame();
+    gc_array_push(arr, elem);
+}
+
+_Bool not_every_11th(void *elem, size_t index, void *arg) {
+    return (index % 11) != 0;
 }
 
 struct Nested1 *alt_fun2() {
-    struct StackFrame_alt_fun2 stack_frame;
-    memset(&stack_frame, 0, sizeof(stack_frame));
-    stack_frame.id = 5;
-    gc_push_stack_frame((void *) (&stack_frame));
-    stack_frame.nested = alloc_nested(10, "hello");
-    {
-        gc_pop_stack_frame();
-        return stack_frame.nested;
-    }
-    gc_pop_stack_frame();
+    struct Nested1 *nested;
+    nested = alloc_nested(10, "hello");
+    return nested;
 }
 
 ArrayType alt_fun1() {
     struct StackFrame_alt_fun1 stack_frame;
     memset(&stack_frame, 0, sizeof(stack_frame));
-    stack_frame.id = 6;
+    stack_frame.id = 3;
     gc_push_stack_frame((void *) (&stack_frame));
     stack_frame.arr = alloc_string_arr(100);
-    stack_frame.nested = alt_fun2();
     while (stack_frame.arr.len > 9) {
-        for (int i = 0; i < stack_frame.arr.len; i += 10) {
-            moving_delete(&stack_frame.arr, i);
-        }
-
+        gc_array_retain_if(&stack_frame.arr, not_every_11th, 0);
         printf("Running gc\n");
         gc_run();
     }
 
+    struct Nested1 *nested = alt_fun2();
     gc_run();
     gc_run();
     {
@@ -433,37 +255,39 @@ ArrayType alt_fun1() {
 int main() {
     struct StackFrame_main stack_frame;
     memset(&stack_frame, 0, sizeof(stack_frame));
-    stack_frame.id = 7;
+    stack_frame.id = 4;
     gc_push_stack_frame((void *) (&stack_frame));
+    struct GCScratch gc_scratch_0;
+    gc_scratch_init(&gc_scratch_0);
+    srand(time(0));
     stack_frame.main_array = alt_fun1();
     stack_frame.third = stack_frame.main_array.arr[3];
-    stack_frame.fourth = stack_frame.main_array.arr[4];
-    stack_frame.nested = alloc_nested_array();
-    srand(time(0));
+    GCString fourth = stack_frame.main_array.arr[4];
     printf("third val: %s\n", stack_frame.third);
     for (int i = 0; i < stack_frame.main_array.len; i++) {
         printf("Got %s\n", (char *) stack_frame.main_array.arr[i]);
     }
 
+    GCString label = gc_scratch_alloc(&gc_scratch_0, 32);
+    snprintf(label, 32, "%zu strings", stack_frame.main_array.len);
+    puts(label);
     gc_run();
     stack_frame.main_array.arr = 0;
     stack_frame.main_array.len = 0;
-    stack_frame.fourth = 0;
+    fourth = 0;
     gc_run();
+    stack_frame.nested = alloc_nested_array();
     gc_run();
-    stack_frame.ptr = stack_frame.nested.arr.arr[0];
-    printf("Nested %s\n", (char *) stack_frame.ptr->identifier);
+    struct Nested1 *ptr;
+    ptr = stack_frame.nested.arr.arr[0];
+    printf("Nested %s\n", (char *) ptr->identifier);
     printf("third val: %s\n", stack_frame.third);
     gc_pop_stack_frame();
-
-    gc_run();
+    gc_scratch_free(&gc_scratch_0);
 }
 
-struct StackMap STACK_MAP[] = {{0, gc_mark_StackFrame_alloc_string_arr},
-                               {1, gc_mark_StackFrame_alloc_nested},
-                               {2, gc_mark_StackFrame_alloc_nested_array},
-                               {3, gc_mark_StackFrame_moving_delete},
-                               {4, gc_mark_StackFrame_array_push},
-                               {5, gc_mark_StackFrame_alt_fun2},
-                               {6, gc_mark_StackFrame_alt_fun1},
-                               {7, gc_mark_StackFrame_main}};
+struct StackMap STACK_MAP[] = {{0, NULL, &gc_type_StackFrame_alloc_string_arr},
+                               {1, NULL, &gc_type_StackFrame_alloc_nested},
+                               {2, NULL, &gc_type_StackFrame_alloc_nested_array},
+                               {3, NULL, &gc_type_StackFrame_alt_fun1},
+                               {4, NULL, &gc_type_StackFrame_main}};
@@ -3,143 +3,12 @@
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
-#include <glib.h>
 #include <math.h>
+#include <time.h>
 #include <assert.h>
 
 
-typedef double *GCDouble;
-typedef char *GCString;
-typedef void *GCPointer;
-typedef int *GCInt;
-typedef struct {
-    void **arr;
-    size_t len;
-} ArrayType;
-
-
-struct KnownObjects {
-    void *buf[10000];
-    int index;
-} known;
-
-struct StackMap {
-    int index;
-
-    void (*fn_ptr)(void *, GHashTable *);
-};
-
-extern struct StackMap STACK_MAP[];
-
-void *gc_malloc(size_t size) {
-    void *ptr;
-    ptr = malloc(size);
-    memset(ptr, 0, size);
-
-    printf("Allocating %p\n", ptr);
-    known.buf[known.index++] = ptr;
-}
-
-
-void *gc_free(void *ptr, int index_hint) {
-    if (index_hint != -1) {
-        assert(known.buf[index_hint] == ptr);
-        free(ptr);
-        known.buf[index_hint] = NULL;
-    } else {
-        for (int i = 0; i < known.index; i++) {
-            if (known.buf[i] == ptr) {
-                //todo: actually free here
-                known.buf[i] = NULL;
-                return NULL;
-            }
-        }
-        assert(false && "Trying to free a non-gc owned pointer");
-    }
-}
-
-
-void gc_mark_plain(const void *obj, GHashTable *table) {
-    g_hash_table_add(table, (gpointer) obj);
-}
-
-
-void gc_mark_ArrayType1(ArrayType *arr, void (*fnptr)(void *, GHashTable *), GHashTable *table) {
-    if (arr != NULL) {
-        if (arr->arr != NULL) {
-            gc_mark_plain((const void *) arr->arr, table);
-            for (int i = 0; i < arr->len; i++) {
-                gc_mark_plain(arr->arr[i], table);
-                fnptr(arr->arr[i], table);
-            }
-        }
-    }
-}
-
-
-void gc_mark_ArrayType(ArrayType *arr, GHashTable *table) {
-    gc_mark_ArrayType1(arr, (void (*)(void *, GHashTable *)) gc_mark_plain, table);
-}
-
-void gc_mark_GCString(GCString *str, GHashTable *table) {
-    gc_mark_plain((void *) *str, table);
-}
-
-
-void gc_find_unused(GHashTable *marked) {
-    int deadcount = 0;
-    for (int i = 0; i < known.index; i++) {
-        gconstpointer to_check = (gconstpointer) known.buf[i];
-        if (to_check == NULL) {
-            // NULL means we've deallocated that chunk
-            continue;
-        }
-        if (g_hash_table_contains(marked, to_check)) {
-        } else {
-            gc_free(to_check, i);
-            deadcount++;
-        }
-    }
-
-    int livecount = 0;
-    for (int i = 0; i < known.index; i++) {
-        if (known.buf[i] != NULL) {
-            livecount++;
-        }
-    }
-    printf("Dead count: %d; Livecount: %d\n", deadcount, livecount);
-
-}
-
-void *g_stack_frames[1000];
-size_t g_sf_index = 0;
-
-void gc_push_stack_frame(void *ptr) {
-    g_stack_frames[g_sf_index++] = ptr;
-}
-
-void gc_pop_stack_frame() {
-    g_stack_frames[g_sf_index] = NULL;
-    g_sf_index--;
-}
-
-void *gc_peek_stack_frame(size_t index) {
-    return g_stack_frames[index];
-}
-
-void gc_run() {
-    GHashTable *table = g_hash_table_new(g_direct_hash, g_direct_equal);
-
-    for (ssize_t i = g_sf_index - 1; i >= 0; i--) {
-        void *cur_stack = gc_peek_stack_frame(i);
-        int stack_id = *(int *) cur_stack;
-        void (*ptr)(void *, GHashTable *) = STACK_MAP[stack_id].fn_ptr;
-        ptr(cur_stack, table);
-    }
-    gc_find_unused(table);
-    g_hash_table_destroy(table);
-
-}
+#include "gc_runtime.h"
 
 struct Nested1 {
     ArrayType arr;
@@ -149,17 +18,21 @@ struct Nested1 {
 struct ArrOfNested {
     ArrayType arr;
 
-    void (*fnptr)(void *, GHashTable *);
+    const struct GCType *element;
 };
 
-void gc_mark_Nested1(struct Nested1 *stc, GHashTable *table);
+extern const struct GCType gc_type_Nested1;
 
-void gc_mark_ArrOfNested(struct ArrOfNested *arr, GHashTable *table) {
-    if (arr != NULL && arr->fnptr != NULL) {
-        gc_mark_ArrayType1(&arr->arr, arr->fnptr, table);
+void gc_mark_ArrOfNested(struct ArrOfNested *arr, struct MarkState *state) {
+    if (arr != NULL && arr->element != NULL) {
+        gc_mark_ArrayType_typed(&arr->arr, arr->element, state);
     }
 }
 
+// The type of its elements is only known at run time, so it's marked by hand.
+const struct GCType gc_type_ArrOfNested = {.size = sizeof(struct ArrOfNested),
+        .mark = (void (*)(void *, struct MarkState *)) gc_mark_ArrOfNested};
+
 const int END_CODE_HERE;
 
 
@@ -176,6 +49,7 @@ GCString gc_string1(const char *source) {
 ArrayType alloc_string_arr(size_t length) {
     ArrayType arr;
     arr.len = length;
+    arr.capacity = length;
     arr.arr = gc_malloc(length * sizeof(void *));
     for (int i = 0; i < length; i++) {
         long rand_num = random();
@@ -184,7 +58,6 @@ ArrayType alloc_string_arr(size_t length) {
         snprintf(arr.arr[i], strlen, "%ld", rand_num);
     }
 
-    gc_run();
     printf("%s\n", arr.arr[0]);
     return arr;
 }
@@ -194,14 +67,14 @@ struct Nested1 *alloc_nested(int arr_len, const char *identifier) {
     struct Nested1 *ret = gc_malloc(sizeof(struct Nested1));
     ret->arr = alloc_string_arr(arr_len);
     ret->identifier = gc_string1(identifier);
-    gc_run();
     return ret;
 }
 
 struct ArrOfNested alloc_nested_array() {
     struct ArrOfNested arr;
-    arr.fnptr = gc_mark_Nested1;
+    arr.element = &gc_type_Nested1;
     arr.arr.len = 100;
+    arr.arr.capacity = 100;
     arr.arr.arr = gc_malloc(arr.arr.len * sizeof(void *));
     for (int i = 0; i < arr.arr.len; i++) {
         arr.arr.arr[i] = alloc_nested(19, "hello world");
@@ -211,14 +84,17 @@ struct ArrOfNested alloc_nested_array() {
 
 void moving_delete(ArrayType *arr, size_t index) {
     assert(index < arr->len);
-    for (size_t i = index; i < arr->len - 1; i++) {
-        arr->arr[i] = arr->arr[i + 1];
-    }
-    arr->len--;
+    gc_array_splice(arr, index, 1, NULL, 0);
 }
 
+// Only for elements without pointers, like GCStrings: the barrier of gc_array_push() marks elem but doesn't trace it, so
+// an array of structs like Nested1 would lose what a young one points to. Those take gc_array_push_typed().
 void array_push(ArrayType *arr, void *elem) {
-    arr->arr[arr->len++] = elem;
+    gc_array_push(arr, elem);
+}
+
+bool not_every_11th(void *elem, size_t index, void *arg) {
+    return index % 11 != 0;
 }
 
 struct Nested1 *alt_fun2() {
@@ -230,10 +106,9 @@ struct Nested1 *alt_fun2() {
 ArrayType alt_fun1() {
     ArrayType arr = alloc_string_arr(100);
 
+    // Deleting every 10th element of what's left, front to back, deletes every 11th one that was there.
     while (arr.len > 9) {
-        for (int i = 0; i < arr.len; i += 10) {
-            moving_delete(&arr, i);
-        }
+        gc_array_retain_if(&arr, not_every_11th, NULL);
         printf("Running gc\n");
         gc_run();
     }
@@ -255,6 +130,9 @@ int main() {
     for (int i = 0; i < main_array.len; i++) {
         printf("Got %s\n", (char *) main_array.arr[i]);
     }
+    GCString label = gc_string(32);
+    snprintf(label, 32, "%zu strings", main_array.len);
+    puts(label);
     gc_run();
     main_array.arr = NULL;
     main_array.len = 0;
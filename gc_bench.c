@@ -0,0 +1,855 @@
+#include <stdio.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "gc_runtime.h"
+#include "runtime.h"
+
+/**
+ * GC pause times. A mutator keeps `live` nodes reachable from its stack frame, and replaces one with a new node per
+ * iteration, so most allocations die young. New nodes get a string and sometimes point to another live node, and
+ * sometimes an old node gets a new string, so there are pointers from old objects to young ones.
+ * Every pause is recorded through gc_pause_hook, for each mode:
+ *  stw:          gc_run_major() every 4 MB allocated.
+ *  generational: gc_run() every 4 MB allocated: minor collections, and a major one when the heap doubled.
+ *  stw-lazy, generational-lazy: the same with lazy sweeping, so allocation sweeps instead of the pause.
+ *  stw-compact:  stw with compaction.
+ *  profile:      generational with the heap profile on, a sample every 512 kB, written to gc_bench.prof.
+ *  auto:         collections triggered by gc_malloc(), with the default growth factor.
+ *  incremental:  incremental cycles, with a step of 1000 objects every 64 kB allocated.
+ *  task:         incremental cycles driven by gc_marker_task(), a step of 1000 objects every time the mutator yields
+ *                (every 64 iterations). Both are tasks of the pre-emptive scheduler, with gc_use_task_stacks().
+ * The other modes turn automatic collections off.
+ * The scaling mode times marking and sweeping with 1, 2, 4 and 8 collector threads instead: `live` nodes (2 million
+ * unless given) stay reachable, and before every major collection as many garbage ones are allocated. Each thread
+ * count reports the fastest of 5 collections.
+ * The calls mode runs call-heavy code instead: every call of a recursive function allocates a node of a binary tree of
+ * depth 16, and keeps it across the two calls that build its children. The last `live` trees (16 unless given) stay
+ * reachable, and `iterations` calls are made, with automatic collections. calls-conservative runs the same code
+ * without stack frames, with conservative roots (gc_set_conservative()) and typed allocations.
+ * The large mode allocates arrays of 1 to 8 MB instead, which go to the large object space: the last `live` (16 unless
+ * given) stay reachable, each points to a string from every 4 kB of it, and `iterations` (2000 unless given) are
+ * allocated, with automatic collections.
+ * The threads mode allocates from 1, 2, 4 and 8 threads at once instead, each attached with gc_attach_thread(): every
+ * thread keeps its own `live` nodes (10000 unless given) and replaces one with a new node and string per iteration,
+ * `iterations` (2 million unless given) times, with automatic collections. It reports allocations per second over all
+ * threads, which only scales with as many cores.
+ * The suite runs a fixed set of workloads instead, each in a fresh process with automatic collections, and writes a
+ * JSON array to `path` (stdout without one) with, for each, its allocation rate, collection count, pause time
+ * percentiles, peak RSS and the bytes live after its last collection, to compare across changes:
+ *  strings: 10 million strings of 16 to 64 bytes, the last 100000 live.
+ *  trees:   GCBench: temporary binary trees of depth 4 to 16, while a tree of depth 16 and a 4 MB array stay live.
+ *  churn:   500000 old nodes with strings, then 5 million new ones that mostly die young, some pointed to by old ones.
+ *  arrays:  arrays of 100 structs, each with an array of 19 strings, like gc.c's alloc_nested_array(), the last 16
+ *           live.
+ * The stack frames and type descriptors are written the way transformer.py generates them, with or without
+ * --conservative.
+ *
+ * Usage: gc_bench [mode] [live] [iterations]
+ *        gc_bench suite [path]
+ */
+
+#define COLLECT_EVERY (4 * 1024 * 1024)
+#define STEP_BUDGET 1000
+#define YIELD_EVERY 64
+#define PROFILE_SAMPLE_BYTES (512 * 1024)
+#define SCALING_RUNS 5
+#define SCALING_LIVE 2000000
+#define CALLS_DEPTH 16
+#define CALLS_LIVE 16
+#define LARGE_LIVE 16
+#define LARGE_ITERATIONS 2000
+#define LARGE_MIN_BYTES (1024 * 1024)
+#define LARGE_MAX_BYTES (8 * 1024 * 1024)
+#define THREADS_MAX 8
+#define THREADS_LIVE 10000
+#define THREADS_ITERATIONS 2000000
+#define SUITE_STRINGS 10000000
+#define SUITE_STRINGS_LIVE 100000
+#define SUITE_TREE_DEPTH 16
+#define SUITE_TREE_ARRAY 500000
+#define SUITE_CHURN 5000000
+#define SUITE_CHURN_OLD 500000
+#define SUITE_CHURN_YOUNG 10000
+#define SUITE_CHURN_PROMOTE 64
+#define SUITE_GRAPHS 2000
+#define SUITE_GRAPHS_LIVE 16
+#define SUITE_GRAPH_NESTED 100
+#define SUITE_NESTED_NAMES 19
+
+struct Node {
+    GCString name;
+    struct Node *next;
+};
+
+struct StackFrame_mutator {
+    int id;
+    ArrayType live;
+    struct Node *node;
+};
+
+extern const struct GCType gc_type_Node;
+
+static const struct GCField gc_pointers_Node[] = {{offsetof(struct Node, name), NULL},
+                                                  {offsetof(struct Node, next), &gc_type_Node}};
+
+const struct GCType gc_type_Node = {.size = sizeof(struct Node), .pointer_count = 2, .pointers = gc_pointers_Node};
+
+static const struct GCField gc_pointers_StackFrame_mutator[] = {
+        {offsetof(struct StackFrame_mutator, node), &gc_type_Node}};
+
+static const struct GCField gc_arrays_StackFrame_mutator[] = {
+        {offsetof(struct StackFrame_mutator, live), &gc_type_Node}};
+
+const struct GCType gc_type_StackFrame_mutator = {.size = sizeof(struct StackFrame_mutator),
+                                                  .pointer_count = 1,
+                                                  .pointers = gc_pointers_StackFrame_mutator,
+                                                  .array_count = 1,
+                                                  .arrays = gc_arrays_StackFrame_mutator};
+
+struct Tree {
+    struct Tree *left, *right;
+};
+
+struct StackFrame_build_tree {
+    int id;
+    struct Tree *tree;
+};
+
+struct StackFrame_calls {
+    int id;
+    ArrayType live;
+};
+
+extern const struct GCType gc_type_Tree;
+
+static const struct GCField gc_pointers_Tree[] = {{offsetof(struct Tree, left), &gc_type_Tree},
+                                                  {offsetof(struct Tree, right), &gc_type_Tree}};
+
+const struct GCType gc_type_Tree = {.size = sizeof(struct Tree), .pointer_count = 2, .pointers = gc_pointers_Tree};
+
+static const struct GCField gc_pointers_StackFrame_build_tree[] = {
+        {offsetof(struct StackFrame_build_tree, tree), &gc_type_Tree}};
+
+const struct GCType gc_type_StackFrame_build_tree = {.size = sizeof(struct StackFrame_build_tree),
+                                                     .pointer_count = 1,
+                                                     .pointers = gc_pointers_StackFrame_build_tree};
+
+static const struct GCField gc_arrays_StackFrame_calls[] = {{offsetof(struct StackFrame_calls, live), &gc_type_Tree}};
+
+const struct GCType gc_type_StackFrame_calls = {.size = sizeof(struct StackFrame_calls),
+                                                .array_count = 1,
+                                                .arrays = gc_arrays_StackFrame_calls};
+
+struct Chunk {
+    ArrayType names;
+};
+
+struct StackFrame_large {
+    int id;
+    ArrayType live;
+    struct Chunk *chunk;
+};
+
+static const struct GCField gc_arrays_Chunk[] = {{offsetof(struct Chunk, names), NULL}};
+
+const struct GCType gc_type_Chunk = {.size = sizeof(struct Chunk), .array_count = 1, .arrays = gc_arrays_Chunk};
+
+static const struct GCField gc_pointers_StackFrame_large[] = {{offsetof(struct StackFrame_large, chunk), &gc_type_Chunk}};
+
+static const struct GCField gc_arrays_StackFrame_large[] = {{offsetof(struct StackFrame_large, live), &gc_type_Chunk}};
+
+const struct GCType gc_type_StackFrame_large = {.size = sizeof(struct StackFrame_large),
+                                                .pointer_count = 1,
+                                                .pointers = gc_pointers_StackFrame_large,
+                                                .array_count = 1,
+                                                .arrays = gc_arrays_StackFrame_large};
+
+struct StackFrame_strings {
+    int id;
+    ArrayType live;
+};
+
+static const struct GCField gc_arrays_StackFrame_strings[] = {{offsetof(struct StackFrame_strings, live), NULL}};
+
+const struct GCType gc_type_StackFrame_strings = {.size = sizeof(struct StackFrame_strings),
+                                                  .array_count = 1,
+                                                  .arrays = gc_arrays_StackFrame_strings};
+
+struct StackFrame_trees {
+    int id;
+    struct Tree *long_lived;
+    GCString array;
+};
+
+static const struct GCField gc_pointers_StackFrame_trees[] = {
+        {offsetof(struct StackFrame_trees, long_lived), &gc_type_Tree},
+        {offsetof(struct StackFrame_trees, array), NULL}};
+
+const struct GCType gc_type_StackFrame_trees = {.size = sizeof(struct StackFrame_trees),
+                                                .pointer_count = 2,
+                                                .pointers = gc_pointers_StackFrame_trees};
+
+struct StackFrame_churn {
+    int id;
+    ArrayType old;
+    ArrayType young;
+    struct Node *node;
+};
+
+static const struct GCField gc_pointers_StackFrame_churn[] = {{offsetof(struct StackFrame_churn, node), &gc_type_Node}};
+
+static const struct GCField gc_arrays_StackFrame_churn[] = {{offsetof(struct StackFrame_churn, old), &gc_type_Node},
+                                                            {offsetof(struct StackFrame_churn, young), &gc_type_Node}};
+
+const struct GCType gc_type_StackFrame_churn = {.size = sizeof(struct StackFrame_churn),
+                                               .pointer_count = 1,
+                                               .pointers = gc_pointers_StackFrame_churn,
+                                               .array_count = 2,
+                                               .arrays = gc_arrays_StackFrame_churn};
+
+// The shape of gc.c's alloc_nested_array(): an array of structs, each with an array of strings and a string.
+struct Nested {
+    ArrayType names;
+    GCString identifier;
+};
+
+struct Graph {
+    ArrayType nested;
+};
+
+struct StackFrame_arrays {
+    int id;
+    ArrayType live;
+    struct Graph *graph;
+    struct Nested *nested;
+};
+
+static const struct GCField gc_pointers_Nested[] = {{offsetof(struct Nested, identifier), NULL}};
+
+static const struct GCField gc_arrays_Nested[] = {{offsetof(struct Nested, names), NULL}};
+
+const struct GCType gc_type_Nested = {.size = sizeof(struct Nested),
+                                      .pointer_count = 1,
+                                      .pointers = gc_pointers_Nested,
+                                      .array_count = 1,
+                                      .arrays = gc_arrays_Nested};
+
+static const struct GCField gc_arrays_Graph[] = {{offsetof(struct Graph, nested), &gc_type_Nested}};
+
+const struct GCType gc_type_Graph = {.size = sizeof(struct Graph), .array_count = 1, .arrays = gc_arrays_Graph};
+
+static const struct GCField gc_pointers_StackFrame_arrays[] = {
+        {offsetof(struct StackFrame_arrays, graph), &gc_type_Graph},
+        {offsetof(struct StackFrame_arrays, nested), &gc_type_Nested}};
+
+static const struct GCField gc_arrays_StackFrame_arrays[] = {{offsetof(struct StackFrame_arrays, live), &gc_type_Graph}};
+
+const struct GCType gc_type_StackFrame_arrays = {.size = sizeof(struct StackFrame_arrays),
+                                                 .pointer_count = 2,
+                                                 .pointers = gc_pointers_StackFrame_arrays,
+                                                 .array_count = 1,
+                                                 .arrays = gc_arrays_StackFrame_arrays};
+
+struct StackMap STACK_MAP[] = {{0, NULL, &gc_type_StackFrame_mutator},
+                               {1, NULL, &gc_type_StackFrame_build_tree},
+                               {2, NULL, &gc_type_StackFrame_calls},
+                               {3, NULL, &gc_type_StackFrame_large},
+                               {4, NULL, &gc_type_StackFrame_strings},
+                               {5, NULL, &gc_type_StackFrame_trees},
+                               {6, NULL, &gc_type_StackFrame_churn},
+                               {7, NULL, &gc_type_StackFrame_arrays}};
+
+enum Mode {
+    STW, GENERATIONAL, STW_LAZY, GENERATIONAL_LAZY, STW_COMPACT, PROFILE, INCREMENTAL, TASK, AUTO, SCALING, CALLS,
+    CALLS_CONSERVATIVE, LARGE, THREADS
+};
+
+const char *mode_names[] = {"stw", "generational", "stw-lazy", "generational-lazy", "stw-compact", "profile",
+                            "incremental", "task", "auto", "scaling", "calls", "calls-conservative", "large",
+                            "threads"};
+
+#define MODES (sizeof mode_names / sizeof mode_names[0])
+
+struct Config {
+    enum Mode mode;
+    size_t live;
+    long iterations;
+} config;
+
+struct Pauses {
+    long *ns;
+    size_t count, capacity;
+} pauses;
+
+void record_pause(long ns) {
+    if (pauses.count == pauses.capacity) {
+        pauses.capacity = pauses.capacity ? pauses.capacity * 2 : 1024;
+        pauses.ns = realloc(pauses.ns, pauses.capacity * sizeof(long));
+    }
+    pauses.ns[pauses.count++] = ns;
+}
+
+static int compare_long(const void *a, const void *b) {
+    return (*(long *) a > *(long *) b) - (*(long *) a < *(long *) b);
+}
+
+static long percentile(double p) {
+    if (pauses.count == 0) return 0;
+    return pauses.ns[(size_t) (p * (double) (pauses.count - 1))];
+}
+
+static long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// gc_malloc() from an allocation site of the heap profile, the line it's on, the way transformer.py tags those of gc.c.
+#define SITE_MALLOC(size, type)                                                         \
+    ({                                                                                  \
+        static const struct GCSite site = {__func__, "gc_bench.c", __LINE__, type};    \
+        gc_site = &site;                                                                \
+        gc_malloc(size);                                                                \
+    })
+
+static GCString new_name(size_t *allocated) {
+    size_t length = 16 + random() % 48;
+    *allocated += length;
+    GCString name = SITE_MALLOC(length, "GCString");
+    snprintf(name, length, "%ld", random());
+    return name;
+}
+
+void mutator() {
+    struct StackFrame_mutator stack_frame;
+    memset(&stack_frame, 0, sizeof stack_frame);
+    stack_frame.id = 0;
+    gc_push_stack_frame((void *) &stack_frame);
+
+    stack_frame.live.len = config.live;
+    stack_frame.live.arr = SITE_MALLOC(config.live * sizeof(void *), "ArrayType");
+    size_t allocated = 0, collected_at = 0;
+    long start = now_ns();
+    for (long i = 0; i < config.iterations; i++) {
+        // In the stack frame, since allocating its name may collect.
+        struct Node *node = stack_frame.node = SITE_MALLOC(sizeof(struct Node), "struct Node");
+        allocated += sizeof(struct Node);
+        node->name = new_name(&allocated);
+        gc_write_barrier_typed(node, &gc_type_Node);
+        struct Node *other = stack_frame.live.arr[random() % config.live];
+        if (other != NULL) {
+            if (random() % 2 == 0 && other->next == NULL) {
+                node->next = other;
+                gc_write_barrier_typed(node, &gc_type_Node);
+            } else if (random() % 8 == 0) {
+                other->name = new_name(&allocated);
+                gc_write_barrier_typed(other, &gc_type_Node);
+            }
+        }
+        stack_frame.live.arr[random() % config.live] = node;
+
+        if (config.mode < INCREMENTAL && allocated - collected_at >= COLLECT_EVERY) {
+            collected_at = allocated;
+            if (config.mode == STW || config.mode == STW_LAZY || config.mode == STW_COMPACT) {
+                gc_run_major();
+            } else {
+                gc_run();
+            }
+        }
+        if (config.mode == TASK && i % YIELD_EVERY == 0) task_yield();
+    }
+    long elapsed = now_ns() - start;
+    gc_pop_stack_frame();
+
+    struct GCStats stats;
+    gc_get_stats(&stats);
+    qsort(pauses.ns, pauses.count, sizeof(long), compare_long);
+    printf("%-17s pauses=%-7zu p50=%-8.1f p90=%-8.1f p99=%-8.1f max=%-8.1f (us) gc=%.1f ms total=%.1f ms "
+           "collections=%zu (%zu major)\n", mode_names[config.mode], pauses.count, percentile(0.5) / 1000.0,
+           percentile(0.9) / 1000.0, percentile(0.99) / 1000.0,
+           pauses.count ? pauses.ns[pauses.count - 1] / 1000.0 : 0.0, stats.total_pause_ns / 1e6, elapsed / 1e6,
+           stats.collections, stats.major_collections);
+    fflush(stdout);
+}
+
+// Nodes point to random older ones, so marking goes through the live array and the pointers between nodes.
+static struct Node *new_node(struct Node **older, size_t count) {
+    size_t allocated = 0;
+    struct Node *node = gc_malloc(sizeof(struct Node));
+    node->name = new_name(&allocated);
+    if (count > 0) node->next = older[random() % count];
+    return node;
+}
+
+void scaling() {
+    struct StackFrame_mutator stack_frame;
+    memset(&stack_frame, 0, sizeof stack_frame);
+    stack_frame.id = 0;
+    gc_push_stack_frame((void *) &stack_frame);
+
+    stack_frame.live.len = config.live;
+    stack_frame.live.arr = gc_malloc(config.live * sizeof(void *));
+    struct Node **live = (struct Node **) stack_frame.live.arr;
+    for (size_t i = 0; i < config.live; i++) live[i] = new_node(live, i);
+
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        gc_set_threads(threads);
+        long mark = 0, sweep = 0;
+        for (int run = 0; run < SCALING_RUNS; run++) {
+            // Garbage: nothing points to it once the next one is allocated.
+            struct Node *garbage = NULL;
+            for (size_t i = 0; i < config.live; i++) garbage = new_node(&garbage, garbage != NULL);
+            gc_run_major();
+            struct GCStats stats;
+            gc_get_stats(&stats);
+            if (run == 0 || stats.last_mark_ns < mark) mark = stats.last_mark_ns;
+            if (run == 0 || stats.last_sweep_ns < sweep) sweep = stats.last_sweep_ns;
+        }
+        // Every node has a string, and the live array is an object too.
+        printf("%-17s threads=%-2d mark=%-8.1f sweep=%-8.1f (ms) marked %.1f M objects/s\n", mode_names[SCALING],
+               threads, mark / 1e6, sweep / 1e6, (2.0 * config.live + 1) / (mark / 1e3));
+        fflush(stdout);
+    }
+    gc_pop_stack_frame();
+}
+
+static struct Tree *build_tree(int depth) {
+    struct StackFrame_build_tree stack_frame;
+    memset(&stack_frame, 0, sizeof stack_frame);
+    stack_frame.id = 1;
+    gc_push_stack_frame((void *) &stack_frame);
+
+    stack_frame.tree = gc_malloc(sizeof(struct Tree));
+    if (depth > 1) {
+        struct Tree *left = build_tree(depth - 1);
+        stack_frame.tree->left = left;
+        gc_write_barrier_typed(stack_frame.tree, &gc_type_Tree);
+        struct Tree *right = build_tree(depth - 1);
+        stack_frame.tree->right = right;
+        gc_write_barrier_typed(stack_frame.tree, &gc_type_Tree);
+    }
+    struct Tree *tree = stack_frame.tree;
+    gc_pop_stack_frame();
+    return tree;
+}
+
+static struct Tree *build_tree_conservative(int depth) {
+    struct Tree *tree = gc_malloc_typed(sizeof(struct Tree), &gc_type_Tree);
+    if (depth > 1) {
+        tree->left = build_tree_conservative(depth - 1);
+        gc_write_barrier_typed(tree, &gc_type_Tree);
+        tree->right = build_tree_conservative(depth - 1);
+        gc_write_barrier_typed(tree, &gc_type_Tree);
+    }
+    return tree;
+}
+
+void calls() {
+    struct StackFrame_calls stack_frame;
+    memset(&stack_frame, 0, sizeof stack_frame);
+    stack_frame.id = 2;
+    bool conservative = config.mode == CALLS_CONSERVATIVE;
+    // Without frames, the live trees are only found through this local.
+    struct Tree **live;
+    if (conservative) {
+        live = gc_malloc(config.live * sizeof(void *));
+    } else {
+        gc_push_stack_frame((void *) &stack_frame);
+        stack_frame.live.len = config.live;
+        live = (struct Tree **) (stack_frame.live.arr = gc_malloc(config.live * sizeof(void *)));
+    }
+
+    long trees = config.iterations >> CALLS_DEPTH;
+    long start = now_ns();
+    for (long i = 0; i < trees; i++) {
+        live[i % config.live] = conservative ? build_tree_conservative(CALLS_DEPTH) : build_tree(CALLS_DEPTH);
+    }
+    long elapsed = now_ns() - start;
+    if (!conservative) gc_pop_stack_frame();
+
+    struct GCStats stats;
+    gc_get_stats(&stats);
+    qsort(pauses.ns, pauses.count, sizeof(long), compare_long);
+    long made = trees << CALLS_DEPTH;
+    // Time per call outside of pauses, i.e. the cost of the code itself.
+    printf("%-18s calls=%-9ld ns/call=%-6.1f p50=%-8.1f max=%-8.1f (us) gc=%.1f ms total=%.1f ms collections=%zu "
+           "(%zu major) live=%.1f MB\n", mode_names[config.mode], made,
+           (double) (elapsed - stats.total_pause_ns) / (double) made,
+           percentile(0.5) / 1000.0, pauses.count ? pauses.ns[pauses.count - 1] / 1000.0 : 0.0,
+           stats.total_pause_ns / 1e6, elapsed / 1e6, stats.collections, stats.major_collections,
+           stats.live_bytes / 1e6);
+    fflush(stdout);
+}
+
+void large() {
+    struct StackFrame_large stack_frame;
+    memset(&stack_frame, 0, sizeof stack_frame);
+    stack_frame.id = 3;
+    gc_push_stack_frame((void *) &stack_frame);
+
+    stack_frame.live.len = config.live;
+    stack_frame.live.arr = gc_malloc(config.live * sizeof(void *));
+    size_t allocated = 0;
+    long start = now_ns();
+    for (long i = 0; i < config.iterations; i++) {
+        size_t length = (LARGE_MIN_BYTES + random() % (LARGE_MAX_BYTES - LARGE_MIN_BYTES)) / sizeof(void *);
+        struct Chunk *chunk = stack_frame.chunk = gc_malloc(sizeof(struct Chunk));
+        chunk->names.len = chunk->names.capacity = length;
+        chunk->names.arr = gc_malloc(length * sizeof(void *));
+        gc_write_barrier_typed(chunk, &gc_type_Chunk);
+        allocated += sizeof(struct Chunk) + length * sizeof(void *);
+        for (size_t j = 0; j < length; j += 4096 / sizeof(void *)) {
+            GCString name = new_name(&allocated);
+            chunk->names.arr[j] = name;
+            gc_write_barrier_typed(chunk, &gc_type_Chunk);
+        }
+        stack_frame.live.arr[i % config.live] = chunk;
+    }
+    long elapsed = now_ns() - start;
+    gc_pop_stack_frame();
+
+    struct GCStats stats;
+    gc_get_stats(&stats);
+    qsort(pauses.ns, pauses.count, sizeof(long), compare_long);
+    // Time per array outside of pauses: mapping it, faulting its pages in and filling it.
+    printf("%-18s arrays=%-6ld us/array=%-7.1f p50=%-8.1f max=%-8.1f (us) gc=%.1f ms total=%.1f ms "
+           "collections=%zu allocated=%.1f GB reused=%zu\n", mode_names[config.mode], config.iterations,
+           (double) (elapsed - stats.total_pause_ns) / 1e3 / (double) config.iterations, percentile(0.5) / 1000.0,
+           pauses.count ? pauses.ns[pauses.count - 1] / 1000.0 : 0.0, stats.total_pause_ns / 1e6, elapsed / 1e6,
+           stats.collections, allocated / 1e9, stats.large_reused);
+    fflush(stdout);
+}
+
+// random() takes a lock, so every thread has its own generator.
+static unsigned long xorshift(unsigned long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void *allocating_thread(void *arg) {
+    gc_attach_thread();
+    struct StackFrame_mutator stack_frame;
+    memset(&stack_frame, 0, sizeof stack_frame);
+    stack_frame.id = 0;
+    gc_push_stack_frame((void *) &stack_frame);
+
+    stack_frame.live.len = config.live;
+    stack_frame.live.arr = gc_malloc(config.live * sizeof(void *));
+    unsigned long state = 88172645463325252UL + (uintptr_t) arg;
+    for (long i = 0; i < config.iterations; i++) {
+        struct Node *node = stack_frame.node = gc_malloc(sizeof(struct Node));
+        GCString name = gc_malloc(16 + xorshift(&state) % 48);
+        name[0] = 0;
+        node->name = name;
+        gc_write_barrier_typed(node, &gc_type_Node);
+        stack_frame.live.arr[xorshift(&state) % config.live] = node;
+    }
+    gc_pop_stack_frame();
+    gc_detach_thread();
+    return NULL;
+}
+
+void threads() {
+    for (long count = 1; count <= THREADS_MAX; count *= 2) {
+        struct GCStats before, after;
+        gc_get_stats(&before);
+        pthread_t threads[THREADS_MAX];
+        long start = now_ns();
+        for (long i = 0; i < count; i++) {
+            if (pthread_create(&threads[i], NULL, allocating_thread, (void *) i) != 0) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        // Parked, so that the allocating threads can collect while this one waits for them.
+        gc_park_thread();
+        for (long i = 0; i < count; i++) pthread_join(threads[i], NULL);
+        gc_unpark_thread();
+        long elapsed = now_ns() - start;
+        gc_get_stats(&after);
+        // A node and a string per iteration.
+        printf("%-17s threads=%-2ld %.1f M allocations/s gc=%.1f ms total=%.1f ms collections=%zu\n",
+               mode_names[THREADS], count, 2.0 * count * config.iterations / (elapsed / 1e3),
+               (after.total_pause_ns - before.total_pause_ns) / 1e6, elapsed / 1e6,
+               after.collections - before.collections);
+        fflush(stdout);
+    }
+}
+
+static GCString suite_name(unsigned long *state) {
+    size_t length = 16 + xorshift(state) % 48;
+    GCString name = gc_malloc(length);
+    snprintf(name, length, "%lu", *state);
+    return name;
+}
+
+static long suite_strings() {
+    struct StackFrame_strings stack_frame;
+    memset(&stack_frame, 0, sizeof stack_frame);
+    stack_frame.id = 4;
+    gc_push_stack_frame((void *) &stack_frame);
+
+    stack_frame.live.len = SUITE_STRINGS_LIVE;
+    stack_frame.live.arr = gc_malloc(SUITE_STRINGS_LIVE * sizeof(void *));
+    unsigned long state = 88172645463325252UL;
+    for (long i = 0; i < SUITE_STRINGS; i++) stack_frame.live.arr[i % SUITE_STRINGS_LIVE] = suite_name(&state);
+    gc_pop_stack_frame();
+    return 1 + SUITE_STRINGS;
+}
+
+// Nodes of a tree build_tree() makes.
+static long tree_size(int depth) {
+    return (1L << depth) - 1;
+}
+
+// After GCBench: a tree deeper than the others, dropped at once, then a long-lived tree and array of doubles that stay
+// live while temporary trees of every other depth from 4 up are built, as many nodes for each depth.
+static long suite_trees() {
+    struct StackFrame_trees stack_frame;
+    memset(&stack_frame, 0, sizeof stack_frame);
+    stack_frame.id = 5;
+    gc_push_stack_frame((void *) &stack_frame);
+
+    build_tree(SUITE_TREE_DEPTH + 1);
+    stack_frame.long_lived = build_tree(SUITE_TREE_DEPTH);
+    stack_frame.array = gc_malloc(SUITE_TREE_ARRAY * sizeof(double));
+    double *array = (double *) stack_frame.array;
+    for (long i = 0; i < SUITE_TREE_ARRAY / 2; i++) array[i] = 1.0 / (double) (i + 1);
+    long allocations = tree_size(SUITE_TREE_DEPTH + 1) + tree_size(SUITE_TREE_DEPTH) + 1;
+    for (int depth = 4; depth <= SUITE_TREE_DEPTH; depth += 2) {
+        long trees = 2 * tree_size(SUITE_TREE_DEPTH + 1) / tree_size(depth);
+        for (long i = 0; i < trees; i++) build_tree(depth);
+        allocations += trees * tree_size(depth);
+    }
+    gc_pop_stack_frame();
+    return allocations;
+}
+
+// A heap of old nodes, and new ones that mostly die young: each stays in a small ring for a while, and some are
+// pointed to by an old node, so there are pointers from old objects to young ones.
+static long suite_churn() {
+    struct StackFrame_churn stack_frame;
+    memset(&stack_frame, 0, sizeof stack_frame);
+    stack_frame.id = 6;
+    gc_push_stack_frame((void *) &stack_frame);
+
+    stack_frame.old.len = SUITE_CHURN_OLD;
+    stack_frame.old.arr = gc_malloc(SUITE_CHURN_OLD * sizeof(void *));
+    stack_frame.young.len = SUITE_CHURN_YOUNG;
+    stack_frame.young.arr = gc_malloc(SUITE_CHURN_YOUNG * sizeof(void *));
+    unsigned long state = 88172645463325252UL;
+    for (long i = 0; i < SUITE_CHURN_OLD + SUITE_CHURN; i++) {
+        // In the stack frame, since allocating its name may collect.
+        struct Node *node = stack_frame.node = gc_malloc(sizeof(struct Node));
+        node->name = suite_name(&state);
+        gc_write_barrier_typed(node, &gc_type_Node);
+        if (i < SUITE_CHURN_OLD) {
+            stack_frame.old.arr[i] = node;
+            continue;
+        }
+        stack_frame.young.arr[i % SUITE_CHURN_YOUNG] = node;
+        unsigned long random = xorshift(&state);
+        if (random % SUITE_CHURN_PROMOTE == 0) {
+            struct Node *old = stack_frame.old.arr[random / SUITE_CHURN_PROMOTE % SUITE_CHURN_OLD];
+            old->next = node;
+            gc_write_barrier_typed(old, &gc_type_Node);
+        }
+    }
+    gc_pop_stack_frame();
+    return 2 + 2 * (SUITE_CHURN_OLD + SUITE_CHURN);
+}
+
+// Arrays of structs holding arrays of strings, like gc.c's alloc_nested_array(), grown one push at a time.
+static long suite_arrays() {
+    struct StackFrame_arrays stack_frame;
+    memset(&stack_frame, 0, sizeof stack_frame);
+    stack_frame.id = 7;
+    gc_push_stack_frame((void *) &stack_frame);
+
+    stack_frame.live.len = SUITE_GRAPHS_LIVE;
+    stack_frame.live.arr = gc_malloc(SUITE_GRAPHS_LIVE * sizeof(void *));
+    unsigned long state = 88172645463325252UL;
+    long allocations = 1;
+    for (long i = 0; i < SUITE_GRAPHS; i++) {
+        struct Graph *graph = stack_frame.graph = gc_malloc(sizeof(struct Graph));
+        for (int j = 0; j < SUITE_GRAPH_NESTED; j++) {
+            struct Nested *nested = stack_frame.nested = gc_malloc(sizeof(struct Nested));
+            nested->names.len = nested->names.capacity = SUITE_NESTED_NAMES;
+            nested->names.arr = gc_malloc(SUITE_NESTED_NAMES * sizeof(void *));
+            gc_write_barrier_typed(nested, &gc_type_Nested);
+            for (int k = 0; k < SUITE_NESTED_NAMES; k++) {
+                GCString name = suite_name(&state);
+                nested->names.arr[k] = name;
+                gc_write_barrier_typed(nested, &gc_type_Nested);
+            }
+            GCString identifier = gc_malloc(sizeof "hello world");
+            strcpy(identifier, "hello world");
+            nested->identifier = identifier;
+            gc_write_barrier_typed(nested, &gc_type_Nested);
+            size_t capacity = graph->nested.capacity;
+            gc_array_push_typed(&graph->nested, nested, &gc_type_Nested);
+            // Growing the array allocates a new buffer.
+            allocations += 3 + SUITE_NESTED_NAMES + (graph->nested.capacity != capacity);
+        }
+        stack_frame.live.arr[i % SUITE_GRAPHS_LIVE] = graph;
+        allocations++;
+    }
+    gc_pop_stack_frame();
+    return allocations;
+}
+
+struct Workload {
+    const char *name;
+    // Runs the workload, and returns how many objects it allocated.
+    long (*run)();
+};
+
+static const struct Workload workloads[] = {
+    {"strings", suite_strings},
+    {"trees", suite_trees},
+    {"churn", suite_churn},
+    {"arrays", suite_arrays},
+};
+
+#define WORKLOADS (sizeof workloads / sizeof workloads[0])
+
+static void run_workload(const struct Workload *workload) {
+    gc_pause_hook = record_pause;
+    gc_verbose = false;
+    long start = now_ns();
+    long allocations = workload->run();
+    long elapsed = now_ns() - start;
+
+    struct GCStats stats;
+    gc_get_stats(&stats);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    qsort(pauses.ns, pauses.count, sizeof(long), compare_long);
+    double seconds = elapsed / 1e9;
+    printf("  {\"workload\": \"%s\", \"seconds\": %.3f, \"allocations\": %ld, \"allocated_bytes\": %zu, "
+           "\"allocations_per_second\": %.0f, \"allocated_bytes_per_second\": %.0f, \"collections\": %zu, "
+           "\"major_collections\": %zu, \"pause_ns\": {\"total\": %ld, \"p50\": %ld, \"p90\": %ld, \"p99\": %ld, "
+           "\"max\": %ld}, \"peak_rss_bytes\": %ld, \"live_bytes\": %zu, \"heap_bytes\": %zu}",
+           workload->name, seconds, allocations, stats.total_allocated_bytes, allocations / seconds,
+           stats.total_allocated_bytes / seconds, stats.collections, stats.major_collections, stats.total_pause_ns,
+           percentile(0.5), percentile(0.9), percentile(0.99), pauses.count ? pauses.ns[pauses.count - 1] : 0,
+           usage.ru_maxrss * 1024L, stats.live_bytes, stats.heap_bytes);
+}
+
+// Runs every workload in a process of its own, so each gets a fresh heap and its own peak RSS, and writes their
+// results as a JSON array to `path`, or stdout without one.
+static int suite(const char *path) {
+    if (path != NULL && freopen(path, "w", stdout) == NULL) {
+        perror("freopen");
+        return 1;
+    }
+    printf("[\n");
+    for (size_t i = 0; i < WORKLOADS; i++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            run_workload(&workloads[i]);
+            exit(0);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "gc_bench: workload %s failed\n", workloads[i].name);
+            return 1;
+        }
+        printf(i + 1 < WORKLOADS ? ",\n" : "\n");
+    }
+    printf("]\n");
+    return 0;
+}
+
+void mutator_task() {
+    mutator();
+    exit(0);
+}
+
+static void run_mode(enum Mode mode) {
+    config.mode = mode;
+    gc_pause_hook = record_pause;
+    gc_verbose = false;
+    if (mode == INCREMENTAL) gc_set_incremental(true, STEP_BUDGET);
+    if (mode == TASK) gc_set_incremental(true, 0);
+    if (mode == STW_LAZY || mode == GENERATIONAL_LAZY) gc_set_lazy_sweep(true);
+    if (mode == STW_COMPACT) gc_set_compaction(true);
+    if (mode == PROFILE) gc_set_profile(PROFILE_SAMPLE_BYTES, "gc_bench.prof");
+    if (mode < INCREMENTAL || mode == SCALING) gc_set_growth(-1);
+    if (mode == SCALING) {
+        gc_pause_hook = NULL;
+        scaling();
+        return;
+    }
+    if (mode == CALLS || mode == CALLS_CONSERVATIVE) {
+        gc_set_conservative(mode == CALLS_CONSERVATIVE);
+        calls();
+        return;
+    }
+    if (mode == LARGE) {
+        large();
+        return;
+    }
+    if (mode == THREADS) {
+        threads();
+        return;
+    }
+
+    if (mode != TASK) {
+        mutator();
+        return;
+    }
+    runtime_init();
+    new_task(&mutator_task);
+    new_task_arg(gc_marker_task, (void *) STEP_BUDGET);
+    gc_use_task_stacks();
+    runtime_run();
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "suite") == 0) return suite(argc > 2 ? argv[2] : NULL);
+    int mode = -1;
+    for (size_t i = 0; argc > 1 && i < MODES; i++) {
+        if (strcmp(argv[1], mode_names[i]) == 0) mode = i;
+    }
+    config.live = argc > 2 ? atol(argv[2])
+                           : mode == SCALING ? SCALING_LIVE : mode == LARGE ? LARGE_LIVE : mode == THREADS ? THREADS_LIVE
+                           : mode >= CALLS ? CALLS_LIVE : 200000;
+    config.iterations = argc > 3 ? atol(argv[3])
+                                 : mode == LARGE ? LARGE_ITERATIONS : mode == THREADS ? THREADS_ITERATIONS : 5000000;
+    if ((argc > 1 && mode < 0 && strcmp(argv[1], "all") != 0) || config.live == 0 || config.iterations <= 0) {
+        fprintf(stderr, "Usage: %s [all|stw|generational|stw-lazy|generational-lazy|stw-compact|profile|"
+                        "incremental|task|auto|scaling|calls|calls-conservative|large|threads] [live] [iterations]\n"
+                        "       %s suite [path]\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (mode >= 0) {
+        run_mode(mode);
+        return 0;
+    }
+    // Every mode gets a fresh heap.
+    for (size_t i = 0; i < MODES; i++) {
+        if (fork() == 0) {
+            run_mode(i);
+            return 0;
+        }
+        wait(NULL);
+    }
+}
@@ -0,0 +1,2256 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <math.h>
+#include <limits.h>
+
+#include "gc_runtime.h"
+
+/**
+ * The GC heap. Small objects live in GC_PAGE_SIZE pages, aligned to their size so the page of an object is found by
+ * masking its address. Every page holds cells of a single size class, each an object header followed by the object.
+ *
+ * Every thread allocates from a current page of its own in each size class (see struct Mutator): first from the page's
+ * free list, then by bumping a pointer through cells that were never used. Pages come from the kernel zeroed, and the
+ * sweep zeroes cells as it frees them, so allocating never clears memory.
+ */
+#define GC_PAGE_SHIFT 16
+#define GC_PAGE_SIZE (1UL << GC_PAGE_SHIFT)
+
+// Pages are mapped from the kernel this many at a time.
+#define GC_CHUNK_PAGES 64
+
+// During an incremental cycle, allocation does a step every GC_STEP_BYTES.
+#define GC_STEP_BYTES (64 * 1024)
+
+// Pages less full than this percentage are evacuated by compacting collections.
+#define GC_EVACUATE_OCCUPANCY 50
+
+// Automatic collections let the heap grow by GC_DEFAULT_GROWTH percent of what's live, unless told otherwise, and
+// don't happen before it reaches GC_MIN_HEAP.
+#define GC_DEFAULT_GROWTH 100
+#define GC_MIN_HEAP (4 * 1024 * 1024)
+
+// Biggest cell of a page. Bigger objects go to the large object space, one mapping each.
+#define GC_MAX_CELL 8192
+
+// Large objects of at least this size are mapped aligned to it and backed by transparent huge pages: the kernel faults
+// them in 2 MB at a time rather than 4 kB, which makes touching a multi-megabyte array several times cheaper.
+#define GC_HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+// At most this many bytes of mappings of dead large objects are kept for new ones (see large_alloc()).
+#define GC_LARGE_CACHE_BYTES (128UL * 1024 * 1024)
+
+// Cell sizes, header included. Steps of 16 bytes up to 128, then four per doubling.
+static const uint32_t class_sizes[] = {
+        32, 48, 64, 80, 96, 112, 128,
+        160, 192, 224, 256,
+        320, 384, 448, 512,
+        640, 768, 896, 1024,
+        1280, 1536, 1792, 2048,
+        2560, 3072, 3584, 4096,
+        5120, 6144, 7168, 8192,
+};
+
+#define GC_SIZE_CLASSES (sizeof class_sizes / sizeof class_sizes[0])
+
+// Most cells a page can have: cells of the smallest class.
+#define GC_PAGE_CELLS (GC_PAGE_SIZE / 32)
+
+// Every object starts with a header, right before the pointer gc_malloc() returns.
+// 16 bytes, so objects keep malloc's alignment.
+struct ObjectHeader {
+    size_t size;
+    // The type gc_malloc_typed() was given, or 0, with SAMPLED set if the heap profile sampled the object. Once a
+    // compacting collection moved the object, the address of its copy instead, with FORWARDED set: types are aligned,
+    // so they never have those bits.
+    uintptr_t info;
+};
+
+#define FORWARDED 1UL
+#define SAMPLED 2UL
+
+/**
+ * Sits at the start of every page, before its cells. The page's cells are the registry of its objects: a cell is
+ * found from an object's address, so freeing one is O(1) and nothing has to be looked up.
+ *
+ * A large object is a page of its own with a single cell, mapped to fit the object, so it's marked and swept the same
+ * way as small ones.
+ */
+struct Page {
+    // Neighbours in the page list of the size class, or in the list of large objects.
+    struct Page *next, *prev;
+    uint32_t cell_size;
+    // The index of the cell at byte offset x (from the first cell) is (x * cell_reciprocal) >> 32, which is exact
+    // for every offset within a page. 0 for large objects, whose only cell has index 0.
+    uint32_t cell_reciprocal;
+    // Number of allocated cells.
+    uint32_t live;
+    // Whether the page is in the nursery, and where.
+    bool young;
+    uint32_t young_index;
+    // With lazy sweeping, which collection left the page to be swept (SWEEP_MINOR or SWEEP_MAJOR), or 0: its
+    // allocated cells without a mark are dead, but not freed yet.
+    uint8_t unswept;
+    // Whether the compacting collection running moves the objects of the page out of it.
+    bool evacuate;
+    // Cells from bump to end were never allocated. Freed cells before bump are on free_list, linked through their
+    // first word.
+    char *bump;
+    char *end;
+    void *free_list;
+    // Size of the mapping of a large object, 0 for pages.
+    size_t mapped;
+    // The thread whose current page it is, if any: only that one allocates from it.
+    struct Mutator *owner;
+    // One bit per cell: whether it holds an object, and whether it was found reachable. Marks are sticky: they stay
+    // set after a collection, which makes the objects that survived one old.
+    uint64_t allocated[GC_PAGE_CELLS / 64];
+    uint64_t marks[GC_PAGE_CELLS / 64];
+};
+
+#define PAGE_HEADER_SIZE ((sizeof(struct Page) + 15) & ~15UL)
+// The 4 kB pages a large object's mapping starts with that hold its page header.
+#define LARGE_HEADER_BYTES ((PAGE_HEADER_SIZE + 4095) & ~4095UL)
+
+enum {
+    SWEEP_MINOR = 1, SWEEP_MAJOR
+};
+
+struct SizeClass {
+    uint32_t cell_size;
+    // All pages of the class. Once the current page of a thread is full, the next one with room that no thread owns is
+    // searched from cursor, which the sweep resets to the head.
+    struct Page *pages;
+    struct Page *cursor;
+    // The page objects evacuated by a compacting collection are moved to.
+    struct Page *evacuation_target;
+};
+
+// A slot to trace, and its type, or if it has none, the gc_mark_* function to trace it with. Entry of the remembered
+// set and the mark stack. An ArrayType whose elements have a type has both: gc_mark_ArrayType and the element type.
+struct Slot {
+    void *slot;
+    void (*fn)(void *, struct MarkState *);
+    const struct GCType *type;
+};
+
+/**
+ * The mark stack holds grey objects: marked, but not traced yet. It's a stack of fixed-size segments, so it grows
+ * without copying what it holds, and never needs one big allocation. If a segment can't be allocated, the object is
+ * traced right away instead, recursively.
+ */
+#define GC_SEGMENT_SLOTS 4096
+
+struct StackSegment {
+    struct StackSegment *below;
+    size_t count;
+    struct Slot slots[GC_SEGMENT_SLOTS];
+};
+
+// Objects are traced this many pops after their prefetch.
+#define GC_PREFETCH_DISTANCE 8
+
+/**
+ * Collections mark and sweep on pool.threads threads: the one collecting and worker threads, each with a marker. Roots
+ * are dealt out between markers, then each traces from its own mark stack, and one out of work steals segments from
+ * the others'. The sweep deals out pages in batches of GC_SWEEP_BATCH, and frees pages left empty afterwards, on the
+ * collecting thread.
+ */
+#define GC_MAX_THREADS 64
+#define GC_SWEEP_BATCH 16
+
+// While others are out of work, a marker checks every GC_SHARE_INTERVAL objects traced whether it can give them some,
+// and does if its top segment has at least GC_SHARE_MIN grey objects.
+#define GC_SHARE_INTERVAL 256
+#define GC_SHARE_MIN 64
+
+struct Marker {
+    // First, so a marker is found from the state passed to the gc_mark_* functions.
+    struct MarkState state;
+    int id;
+    // Guards the segments below the top of the mark stack, which other markers steal.
+    pthread_mutex_t lock;
+    // Last job the worker thread ran.
+    unsigned job_id;
+    // What the marker's share of the sweep freed: objects, their bytes, and pages left without objects.
+    size_t freed;
+    size_t freed_bytes;
+    struct Page **empty;
+    size_t empty_count, empty_capacity;
+};
+
+// markers[0] belongs to the thread collecting, and is also the one of incremental cycles.
+static struct Marker markers[GC_MAX_THREADS];
+
+struct Pool {
+    int threads;
+    // Worker threads running, for markers[1] to markers[started].
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    // The job workers run, bumped job_id, and how many of them haven't finished it yet.
+    void (*job)(struct Marker *);
+    unsigned job_id;
+    int running;
+    // Markers taking part in the marking running, and how many of them haven't run out of grey objects. Marking is
+    // over once none are active.
+    int markers;
+    int active;
+} pool = {.threads = 1, .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+          .done = PTHREAD_COND_INITIALIZER};
+
+struct ProfileSite {
+    const struct GCSite *site;
+    // Estimates, from the samples: a sample of s bytes stands for 1 / (1 - exp(-s / sample_bytes)) objects.
+    double allocated_objects, allocated_bytes;
+};
+
+struct Sample {
+    void *obj;
+    size_t site;
+    double weight;
+};
+
+/**
+ * A thread using the heap: the program's, or one that called gc_attach_thread(). Its current pages are its allocation
+ * buffers, which no other thread allocates from, so allocating from them takes no lock. What it allocated there is
+ * counted here, and added to the heap's counts (flushed) whenever it takes the heap lock to get a new page, and when a
+ * collection stops the threads. The slots its write barriers remember wait here too.
+ */
+struct Mutator {
+    struct Page *current[GC_SIZE_CLASSES];
+    // Since the last flush: bytes and objects allocated in the current pages.
+    size_t bytes, objects;
+    struct Slot *remembered;
+    size_t remembered_count, remembered_capacity;
+    // Heap profile: the thread counts down until_sample, and takes the heap's sample_bytes once it takes the lock.
+    size_t sample_bytes;
+    long until_sample;
+    // The thread's shadow stack, the first one of the list of the stacks of its tasks (see gc_switch_stack()).
+    struct GCShadowStack stack;
+    struct Mutator *next;
+};
+
+static struct Mutator main_mutator = {.until_sample = LONG_MAX, .stack = {.registered = true}};
+
+// The thread's Mutator. Threads other than the program's set it in gc_attach_thread().
+static __thread struct Mutator *current_mutator = &main_mutator;
+
+struct Heap {
+    struct SizeClass classes[GC_SIZE_CLASSES];
+    // Size class of every cell size, in steps of 16 bytes.
+    uint8_t class_of[GC_MAX_CELL / 16];
+    // Mapped pages no size class uses.
+    struct Page *unused_pages;
+    size_t mapped_pages;
+    // All large objects.
+    struct Page *large;
+    // Mappings of dead large objects, kept to be reused, and their total size.
+    struct Page *large_cache;
+    size_t large_cache_bytes;
+
+    // The nursery: pages objects were allocated in since the last collection, i.e. the pages that were the current
+    // page of their size class, and new large objects. Young objects can only be in these pages, so a minor
+    // collection only sweeps them.
+    struct Page **young;
+    size_t young_count, young_capacity;
+
+    // The remembered set: slots of old objects written to since the last collection.
+    struct Slot *remembered;
+    size_t remembered_count, remembered_capacity;
+
+    // Bytes in use right after the last major collection, and after the last collection. With lazy sweeping, what
+    // pages left unswept free once swept comes off both, if they were left by the major one.
+    size_t major_bytes;
+    size_t live_bytes;
+
+    /**
+     * Automatic collections, triggered by allocation. The heap grows by growth percent of live_bytes before the next
+     * collection, at trigger_bytes, and old objects (live_bytes) by growth percent of major_bytes before a collection
+     * is major. With incremental collection, cycles start once the heap grew by growth percent of major_bytes.
+     * Negative growth turns automatic collections off, and gc_run() picks major collections as with the default.
+     */
+    int growth;
+    size_t trigger_bytes;
+
+    /**
+     * Lazy sweeping: collections leave the pages of size classes unswept, and allocation sweeps them one at a time,
+     * once it gets to them looking for room. Pages still unswept when the next major collection starts don't need to
+     * be: their dead objects stay unmarked, so it frees them. Objects in the unswept pages still count in objects and
+     * bytes, and the pages aren't allocated from.
+     */
+    bool lazy_sweep;
+    size_t unswept_pages;
+
+    /**
+     * Incremental collection. A major collection runs as a cycle of steps the program runs between: the first marks
+     * the roots, the others trace grey objects, and once none are left the last step rescans the roots and sweeps.
+     * While marking, objects are allocated marked, gc_write_barrier() makes marked objects grey again, and gc_free()
+     * of marked objects waits for the end of the cycle, since they may still be grey.
+     */
+    bool incremental;
+    bool marking;
+    // Marking work (in objects) done every GC_STEP_BYTES allocated during a cycle, and the bytes allocated since the
+    // last step.
+    size_t step_budget;
+    size_t step_bytes;
+    // Objects gc_free() was called on during the cycle.
+    void **deferred;
+    size_t deferred_count, deferred_capacity;
+
+    /**
+     * Compaction: major collections the program runs (rather than gc_malloc()) evacuate the pages of size classes
+     * less than GC_EVACUATE_OCCUPANCY percent full. The first time marking reaches an object in one, it's copied to
+     * the evacuation target of its class, and its old header forwards to the copy: the slot it was reached through,
+     * and every other one it's reached through afterwards, is updated. Marking reaches every object through every
+     * slot pointing to it, so once it's done nothing points to the evacuated pages, and the sweep frees them.
+     */
+    bool compaction;
+    bool evacuating;
+    struct Page **evacuated;
+    size_t evacuated_count, evacuated_capacity;
+
+    /**
+     * Conservative roots: marking also scans the stacks of the program, from stack_low to stack_top for the thread
+     * that turned it on, and the others through gc_scan_stacks_hook. Every word pointing into an allocated object keeps
+     * it alive, and pins it: conservative collections don't compact.
+     */
+    bool conservative;
+    const char *stack_low, *stack_top;
+
+    // Whether several markers are marking, so marks are set atomically, and whether they trace the remembered set.
+    bool parallel;
+    bool mark_remembered;
+    // Pages the sweep goes through, and the index of the next batch of them to sweep.
+    struct Page **sweep_pages;
+    size_t sweep_count, sweep_capacity;
+    size_t sweep_next;
+
+    struct GCStats stats;
+
+    /**
+     * Heap profile (see gc_set_profile()). Allocation counts down the until_sample of its thread, and samples the
+     * object that makes it negative, so it's LONG_MAX while profiling is off. The sites sampled objects were allocated
+     * at, with how many objects and bytes the samples stand for, and the sampled objects not found dead yet.
+     */
+    size_t sample_bytes;
+    uint64_t sample_random;
+    const char *profile_path;
+    bool profile_stale;
+    struct ProfileSite *profile_sites;
+    size_t profile_site_count, profile_site_capacity;
+    struct Sample *samples;
+    size_t sample_count, sample_capacity;
+
+    // Objects allocated and not freed yet, and the bytes they take up (whole cells and mappings). Kept up to date
+    // by allocation, gc_free() and the sweep, rather than counted. Allocations in the buffers of threads are added
+    // once they're flushed.
+    size_t objects;
+    size_t bytes;
+    bool ready;
+
+    /**
+     * Threads. The lock guards the heap, apart from the allocation buffers of the threads. Collections hold it
+     * throughout, and stop the threads first: stopping makes every thread that allocates, or takes the lock at a
+     * safepoint, wait in wait_world() until it's cleared, and the collection waits until running, the number of threads
+     * neither waiting nor parked (gc_park_thread()), is down to its own.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t stopped, resumed;
+    bool stopping;
+    int running;
+    // All threads, and their number.
+    struct Mutator *mutators;
+    int threads;
+} heap = {.growth = GC_DEFAULT_GROWTH, .trigger_bytes = GC_MIN_HEAP, .sample_random = 0x9e3779b97f4a7c15,
+        .lock = PTHREAD_MUTEX_INITIALIZER, .stopped = PTHREAD_COND_INITIALIZER, .resumed = PTHREAD_COND_INITIALIZER,
+        .running = 1, .mutators = &main_mutator, .threads = 1};
+
+/**
+ * Page map: the page of every GC_PAGE_SIZE granule of address space the heap has mapped, so any address is found to
+ * be in the heap or not with two loads. The first level is indexed by bits 46 to 32 of the address, the second by
+ * bits 31 to 16.
+ */
+#define PAGE_MAP_ROOTS (1UL << 15)
+#define PAGE_MAP_LEAVES (1UL << (32 - GC_PAGE_SHIFT))
+
+static struct Page **page_map[PAGE_MAP_ROOTS];
+
+static void page_map_set(char *start, size_t size, struct Page *page) {
+    for (uintptr_t granule = (uintptr_t) start; granule < (uintptr_t) start + size; granule += GC_PAGE_SIZE) {
+        struct Page ***leaves = &page_map[granule >> 32];
+        if (*leaves == NULL) {
+            *leaves = calloc(PAGE_MAP_LEAVES, sizeof(struct Page *));
+            if (*leaves == NULL) {
+                perror("GC page map");
+                exit(1);
+            }
+        }
+        (*leaves)[(granule >> GC_PAGE_SHIFT) & (PAGE_MAP_LEAVES - 1)] = page;
+    }
+}
+
+static struct Page *page_lookup(const void *addr) {
+    uintptr_t address = (uintptr_t) addr;
+    if (address >> 32 >= PAGE_MAP_ROOTS) return NULL;
+    struct Page **leaves = page_map[address >> 32];
+    return leaves != NULL ? leaves[(address >> GC_PAGE_SHIFT) & (PAGE_MAP_LEAVES - 1)] : NULL;
+}
+
+static struct ObjectHeader *gc_header(const void *obj) {
+    return (struct ObjectHeader *) obj - 1;
+}
+
+// The address of the copy of an object a compacting collection moved, or NULL if it didn't.
+static void *forwarded(const struct ObjectHeader *header) {
+    return header->info & FORWARDED ? (void *) (header->info & ~FORWARDED) : NULL;
+}
+
+static bool is_large(const struct ObjectHeader *header) {
+    return sizeof(struct ObjectHeader) + header->size > GC_MAX_CELL;
+}
+
+// Also finds the page of a large object from its header, which is in the first GC_PAGE_SIZE of its mapping.
+static struct Page *page_of(const void *cell) {
+    return (struct Page *) ((uintptr_t) cell & ~(uintptr_t) (GC_PAGE_SIZE - 1));
+}
+
+// First cell of a page, after the page header.
+static char *page_cells(struct Page *page) {
+    return (char *) page + PAGE_HEADER_SIZE;
+}
+
+// Index of the cell addr points into.
+static uint32_t cell_index(struct Page *page, const void *addr) {
+    return (uint32_t) (((uint64_t) ((const char *) addr - page_cells(page)) * page->cell_reciprocal) >> 32);
+}
+
+// Threads may get here at the same time, before one of them set ready.
+static void heap_init() {
+    pthread_mutex_lock(&heap.lock);
+    if (heap.ready) {
+        pthread_mutex_unlock(&heap.lock);
+        return;
+    }
+    size_t class = 0;
+    for (uint32_t size = 16; size <= GC_MAX_CELL; size += 16) {
+        if (size > class_sizes[class]) class++;
+        heap.class_of[size / 16 - 1] = class;
+    }
+    for (size_t i = 0; i < GC_SIZE_CLASSES; i++) {
+        heap.classes[i].cell_size = class_sizes[i];
+    }
+    for (int i = 0; i < GC_MAX_THREADS; i++) {
+        markers[i].id = i;
+        pthread_mutex_init(&markers[i].lock, NULL);
+    }
+    __atomic_store_n(&heap.ready, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&heap.lock);
+}
+
+// Maps size bytes, aligned to alignment, a multiple of GC_PAGE_SIZE.
+static char *map_aligned(size_t size, size_t alignment, const char *what) {
+    // Map alignment bytes more than needed, then unmap the ends so what's left is aligned.
+    char *mapping = mmap(NULL, size + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        perror(what);
+        exit(1);
+    }
+    char *start = (char *) (((uintptr_t) mapping + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    if (start > mapping) munmap(mapping, start - mapping);
+    if (start + size < mapping + size + alignment) munmap(start + size, mapping + alignment - start);
+    return start;
+}
+
+// Maps GC_CHUNK_PAGES pages at once and adds them to the unused pages.
+static void map_chunk() {
+    char *start = map_aligned((size_t) GC_CHUNK_PAGES * GC_PAGE_SIZE, GC_PAGE_SIZE, "GC heap");
+    for (int i = GC_CHUNK_PAGES - 1; i >= 0; i--) {
+        struct Page *page = (struct Page *) (start + (size_t) i * GC_PAGE_SIZE);
+        page_map_set((char *) page, GC_PAGE_SIZE, page);
+        page->next = heap.unused_pages;
+        heap.unused_pages = page;
+    }
+    heap.mapped_pages += GC_CHUNK_PAGES;
+}
+
+static void list_push(struct Page **head, struct Page *page) {
+    page->prev = NULL;
+    page->next = *head;
+    if (*head != NULL) (*head)->prev = page;
+    *head = page;
+}
+
+static void list_remove(struct Page **head, struct Page *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        *head = page->next;
+    }
+    if (page->next != NULL) page->next->prev = page->prev;
+}
+
+// Makes room for one more element in a growable array.
+static void *reserve(void *array, size_t count, size_t *capacity, size_t size, const char *what) {
+    if (count < *capacity) return array;
+    *capacity = *capacity ? *capacity * 2 : 256;
+    array = realloc(array, *capacity * size);
+    if (array == NULL) {
+        perror(what);
+        exit(1);
+    }
+    return array;
+}
+
+static void add_young(struct Page *page) {
+    if (page->young) return;
+    heap.young = reserve(heap.young, heap.young_count, &heap.young_capacity, sizeof(struct Page *), "GC nursery");
+    page->young = true;
+    page->young_index = heap.young_count;
+    heap.young[heap.young_count++] = page;
+}
+
+// The last page of the nursery takes the place of the one removed.
+static void remove_young(struct Page *page) {
+    if (!page->young) return;
+    struct Page *last = heap.young[--heap.young_count];
+    heap.young[page->young_index] = last;
+    last->young_index = page->young_index;
+    page->young = false;
+}
+
+// Pages on the unused list are all zeroes, apart from the link.
+static struct Page *new_page(struct SizeClass *class) {
+    if (heap.unused_pages == NULL) map_chunk();
+    struct Page *page = heap.unused_pages;
+    heap.unused_pages = page->next;
+
+    char *cells = page_cells(page);
+    page->cell_size = class->cell_size;
+    page->cell_reciprocal = (uint32_t) (((1UL << 32) + class->cell_size - 1) / class->cell_size);
+    page->live = 0;
+    page->bump = cells;
+    page->end = cells + (GC_PAGE_SIZE - PAGE_HEADER_SIZE) / class->cell_size * class->cell_size;
+    page->free_list = NULL;
+    list_push(&class->pages, page);
+    return page;
+}
+
+static struct SizeClass *class_of_page(struct Page *page) {
+    return &heap.classes[heap.class_of[(page->cell_size - 1) / 16]];
+}
+
+// Gives a page whose objects are all dead back to the unused pages. Its cells must be zeroed already: the sweep zeroes
+// the cells in use at once, which is cheaper than zeroing every dead object on its own.
+static void release_page(struct Page *page) {
+    struct SizeClass *class = class_of_page(page);
+    list_remove(&class->pages, page);
+    if (page->owner != NULL) page->owner->current[class - heap.classes] = NULL;
+    remove_young(page);
+
+    memset(page, 0, sizeof(struct Page));
+    page->next = heap.unused_pages;
+    heap.unused_pages = page;
+}
+
+// A page's bump and bitmaps are changed by one thread at a time, but the write barriers of other threads read them (see
+// in_old_object()), so they're stored atomically. Relaxed stores are plain ones on x86.
+static void set_bits(uint64_t *word, uint64_t bits) {
+    __atomic_store_n(word, *word | bits, __ATOMIC_RELAXED);
+}
+
+static void clear_bits(uint64_t *word, uint64_t bits) {
+    __atomic_store_n(word, *word & ~bits, __ATOMIC_RELAXED);
+}
+
+static void *page_alloc(struct Page *page) {
+    void *cell = page->free_list;
+    if (cell != NULL) {
+        page->free_list = *(void **) cell;
+        *(void **) cell = NULL;
+    } else if (page->bump < page->end) {
+        cell = page->bump;
+        __atomic_store_n(&page->bump, page->bump + page->cell_size, __ATOMIC_RELAXED);
+    } else {
+        return NULL;
+    }
+    uint32_t index = cell_index(page, cell);
+    set_bits(&page->allocated[index / 64], 1UL << (index % 64));
+    if (heap.marking) set_bits(&page->marks[index / 64], 1UL << (index % 64));
+    page->live++;
+    return cell;
+}
+
+// Zeroes the cell and puts it on the page's free list. Its mark goes too, so the next object in it starts young.
+static void free_cell(struct Page *page, void *cell, uint32_t index) {
+    memset(cell, 0, page->cell_size);
+    *(void **) cell = page->free_list;
+    page->free_list = cell;
+    clear_bits(&page->allocated[index / 64], 1UL << (index % 64));
+    clear_bits(&page->marks[index / 64], 1UL << (index % 64));
+    page->live--;
+}
+
+static bool sweep_lazily(struct Page *page);
+
+// The thread's current page is full: switch to the next page with room that no other thread allocates from, or to a
+// new one. Either way it joins the nursery. Unswept pages on the way are swept first.
+static void *class_refill(struct Mutator *mutator, struct SizeClass *class) {
+    struct Page **current = &mutator->current[class - heap.classes];
+    struct Page *page = NULL;
+    for (struct Page *next; class->cursor != NULL; class->cursor = next) {
+        struct Page *candidate = class->cursor;
+        next = candidate->next;
+        if (candidate->unswept != 0 && sweep_lazily(candidate)) continue;
+        // The full current page is owned by this thread, so it's skipped too.
+        if (candidate->owner == NULL && (candidate->free_list != NULL || candidate->bump < candidate->end)) {
+            page = candidate;
+            break;
+        }
+    }
+    if (page == NULL) page = new_page(class);
+    if (*current != NULL) (*current)->owner = NULL;
+    page->owner = mutator;
+    *current = page;
+    add_young(page);
+    return page_alloc(page);
+}
+
+// The smallest cached mapping of at least mapped bytes, taken out of the cache, or NULL.
+static struct Page *large_cache_take(size_t mapped) {
+    struct Page *best = NULL;
+    for (struct Page *page = heap.large_cache; page != NULL; page = page->next) {
+        if (page->mapped >= mapped && (best == NULL || page->mapped < best->mapped)) best = page;
+    }
+    if (best != NULL) {
+        list_remove(&heap.large_cache, best);
+        heap.large_cache_bytes -= best->mapped;
+    }
+    return best;
+}
+
+static void large_cache_release() {
+    while (heap.large_cache != NULL) {
+        struct Page *page = heap.large_cache;
+        list_remove(&heap.large_cache, page);
+        munmap(page, page->mapped);
+    }
+    heap.large_cache_bytes = 0;
+}
+
+/**
+ * Objects that don't fit in a cell get their own mapping. Mapping one costs system calls, and a map_aligned() that
+ * trims, so the smallest cached mapping of a dead large object that's big enough is reused instead: what the new object
+ * doesn't need of it is unmapped, and only its first 4 kB page, with the header, is cleared. large_free() gave the rest
+ * back to the kernel, which faults it in zeroed like a fresh mapping.
+ */
+static struct ObjectHeader *large_alloc(size_t size) {
+    size_t cell_size = sizeof(struct ObjectHeader) + size;
+    size_t mapped = (PAGE_HEADER_SIZE + cell_size + 4095) & ~4095UL;
+    bool huge = mapped >= GC_HUGE_PAGE_SIZE;
+    struct Page *page = large_cache_take(mapped);
+    if (page != NULL) {
+        if (page->mapped > mapped) munmap((char *) page + mapped, page->mapped - mapped);
+        memset(page, 0, LARGE_HEADER_BYTES);
+        heap.stats.large_reused++;
+    } else {
+        page = (struct Page *) map_aligned(mapped, huge ? GC_HUGE_PAGE_SIZE : GC_PAGE_SIZE, "GC large object");
+        // Only a hint: without transparent huge pages, the mapping is faulted in 4 kB at a time as usual.
+        if (huge) madvise(page, mapped, MADV_HUGEPAGE);
+    }
+    page_map_set((char *) page, mapped, page);
+
+    char *cell = page_cells(page);
+    page->cell_size = cell_size;
+    page->live = 1;
+    page->bump = page->end = cell + cell_size;
+    page->mapped = mapped;
+    page->allocated[0] = 1;
+    page->marks[0] = heap.marking;
+    list_push(&heap.large, page);
+    add_young(page);
+    heap.bytes += mapped;
+    heap.stats.total_allocated_bytes += mapped;
+    return (struct ObjectHeader *) cell;
+}
+
+// The mapping goes to the cache, or back to the kernel if the cache is full. A cached mapping keeps the page with its
+// header, which links it into the cache, but not its memory beyond: MADV_DONTNEED drops it, so reusing the mapping
+// finds it zeroed, and the cache doesn't add to the resident set.
+static void large_free(struct Page *page) {
+    list_remove(&heap.large, page);
+    remove_young(page);
+    heap.bytes -= page->mapped;
+    page_map_set((char *) page, page->mapped, NULL);
+    if (heap.large_cache_bytes + page->mapped > GC_LARGE_CACHE_BYTES) {
+        munmap(page, page->mapped);
+        return;
+    }
+    madvise((char *) page + LARGE_HEADER_BYTES, page->mapped - LARGE_HEADER_BYTES, MADV_DONTNEED);
+    list_push(&heap.large_cache, page);
+    heap.large_cache_bytes += page->mapped;
+}
+
+static void start_cycle();
+
+static void run_collection(bool major, bool requested);
+
+// bytes, plus growth percent of it.
+static size_t grown(size_t bytes) {
+    return bytes + bytes / 100 * (size_t) (heap.growth >= 0 ? heap.growth : GC_DEFAULT_GROWTH);
+}
+
+static size_t heap_limit(size_t bytes) {
+    size_t limit = grown(bytes);
+    return limit > GC_MIN_HEAP ? limit : GC_MIN_HEAP;
+}
+
+// The thread's shadow stack, the current one until gc_switch_stack().
+static __thread struct GCShadowStack *current_stack = &main_mutator.stack;
+
+void gc_push_stack_frame(void *ptr) {
+    struct GCShadowStack *stack = current_stack;
+    stack->frames = reserve(stack->frames, stack->count, &stack->capacity, sizeof(void *), "GC shadow stack");
+    stack->frames[stack->count++] = ptr;
+}
+
+void gc_pop_stack_frame() {
+    assert(current_stack->count > 0);
+    current_stack->count--;
+}
+
+// Stacks are only switched between the tasks of one thread, so the list of its stacks is only changed by the thread.
+void gc_switch_stack(struct GCShadowStack *stack, bool parked) {
+    current_stack->parked = parked;
+    if (!stack->registered) {
+        stack->registered = true;
+        stack->next = current_mutator->stack.next;
+        current_mutator->stack.next = stack;
+    }
+    current_stack = stack;
+}
+
+void gc_stack_clear(struct GCShadowStack *stack) {
+    stack->count = 0;
+    stack->allocated = false;
+}
+
+bool gc_stacks_parked() {
+    for (struct GCShadowStack *stack = &current_mutator->stack; stack != NULL; stack = stack->next) {
+        if (stack != current_stack && (stack->count > 0 || (heap.conservative && stack->allocated)) && !stack->parked) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void (*gc_safepoint_hook)(bool collecting);
+
+// Collections waiting in gc_safepoint_hook() for the other stacks to park. Atomic, since gc_malloc() reads it without
+// the heap lock.
+static int safepoint_waiters;
+
+// Nesting depth of code changing the heap on the thread, which gc_preemptible() reports.
+static __thread volatile int heap_busy;
+
+bool gc_preemptible() {
+    return heap_busy == 0;
+}
+
+// The signal fences keep the compiler from moving heap accesses out of the busy section, as seen by a signal handler
+// on the same thread.
+static void enter_heap() {
+    heap_busy++;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static void leave_heap() {
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    heap_busy--;
+}
+
+// The heap lock is only taken inside the heap code, so a task holding it is never pre-empted for another that wants it.
+static void lock_heap() {
+    enter_heap();
+    pthread_mutex_lock(&heap.lock);
+}
+
+static void unlock_heap() {
+    pthread_mutex_unlock(&heap.lock);
+    leave_heap();
+}
+
+// Called before a collection or step: waits until the other shadow stacks are parked.
+static void safepoint() {
+    if (gc_safepoint_hook == NULL) return;
+    assert(heap_busy == 0);
+    __atomic_fetch_add(&safepoint_waiters, 1, __ATOMIC_RELAXED);
+    gc_safepoint_hook(true);
+    __atomic_fetch_sub(&safepoint_waiters, 1, __ATOMIC_RELAXED);
+}
+
+// With the heap lock, at a safepoint: waits for the collection stopping the threads, if there's one, to resume them.
+static void wait_world() {
+    while (heap.stopping) {
+        heap.running--;
+        pthread_cond_signal(&heap.stopped);
+        pthread_cond_wait(&heap.resumed, &heap.lock);
+        heap.running++;
+    }
+}
+
+static struct Slot *remember(struct Slot *set, size_t *count, size_t *capacity, struct Slot written);
+
+// Adds what the thread allocated in its buffers, and what it remembered, to the heap's.
+static void flush_mutator(struct Mutator *mutator) {
+    heap.bytes += mutator->bytes;
+    heap.objects += mutator->objects;
+    heap.stats.total_allocated_bytes += mutator->bytes;
+    if (heap.marking) heap.step_bytes += mutator->bytes;
+    mutator->bytes = mutator->objects = 0;
+    for (size_t i = 0; i < mutator->remembered_count; i++) {
+        heap.remembered = remember(heap.remembered, &heap.remembered_count, &heap.remembered_capacity,
+                                   mutator->remembered[i]);
+    }
+    mutator->remembered_count = 0;
+}
+
+/**
+ * With the heap lock, which a collection then holds until it's done: stops the other threads, once each is waiting in
+ * wait_world() or parked. Threads notice at their next allocation, or gc_safepoint(). Their buffers are flushed, so
+ * the heap's counts and remembered set are complete.
+ */
+static void stop_world() {
+    __atomic_store_n(&heap.stopping, true, __ATOMIC_RELAXED);
+    while (heap.running > 1) pthread_cond_wait(&heap.stopped, &heap.lock);
+    for (struct Mutator *mutator = heap.mutators; mutator != NULL; mutator = mutator->next) flush_mutator(mutator);
+}
+
+static void resume_world() {
+    __atomic_store_n(&heap.stopping, false, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&heap.resumed);
+}
+
+void gc_safepoint() {
+    if (!__atomic_load_n(&heap.stopping, __ATOMIC_RELAXED)) return;
+    lock_heap();
+    wait_world();
+    unlock_heap();
+}
+
+void gc_attach_thread() {
+    if (!__atomic_load_n(&heap.ready, __ATOMIC_ACQUIRE)) heap_init();
+    struct Mutator *mutator = calloc(1, sizeof(struct Mutator));
+    if (mutator == NULL) {
+        perror("GC thread");
+        exit(1);
+    }
+    mutator->until_sample = LONG_MAX;
+    mutator->stack.registered = true;
+    lock_heap();
+    if (heap.conservative) {
+        fprintf(stderr, "GC thread: conservative roots are only found on the stacks of one thread\n");
+        exit(1);
+    }
+    // The hook switches tasks of the program thread's scheduler, which another thread must not do.
+    if (gc_safepoint_hook != NULL) {
+        fprintf(stderr, "GC thread: task stacks are only switched on the program's thread\n");
+        exit(1);
+    }
+    heap.running++;
+    wait_world();
+    mutator->next = heap.mutators;
+    heap.mutators = mutator;
+    heap.threads++;
+    unlock_heap();
+    current_mutator = mutator;
+    current_stack = &mutator->stack;
+}
+
+// The pages the thread allocated from are left to the others.
+void gc_detach_thread() {
+    struct Mutator *mutator = current_mutator;
+    assert(mutator != &main_mutator && mutator->stack.count == 0 && mutator->stack.next == NULL);
+    lock_heap();
+    wait_world();
+    flush_mutator(mutator);
+    for (size_t i = 0; i < GC_SIZE_CLASSES; i++) {
+        if (mutator->current[i] != NULL) mutator->current[i]->owner = NULL;
+    }
+    struct Mutator **link = &heap.mutators;
+    while (*link != mutator) link = &(*link)->next;
+    *link = mutator->next;
+    heap.threads--;
+    heap.running--;
+    unlock_heap();
+    free(mutator->stack.frames);
+    free(mutator->remembered);
+    free(mutator);
+    current_mutator = NULL;
+    current_stack = NULL;
+}
+
+void gc_park_thread() {
+    lock_heap();
+    heap.running--;
+    pthread_cond_signal(&heap.stopped);
+    unlock_heap();
+}
+
+void gc_unpark_thread() {
+    lock_heap();
+    heap.running++;
+    wait_world();
+    unlock_heap();
+}
+
+__thread const struct GCSite *gc_site;
+
+static void sample(struct Mutator *mutator, struct ObjectHeader *header, const struct GCSite *site);
+
+static long sample_interval();
+
+// With the heap lock: the thread samples with the heap's interval from now on.
+static void sync_sampling(struct Mutator *mutator) {
+    if (mutator->sample_bytes == heap.sample_bytes) return;
+    mutator->sample_bytes = heap.sample_bytes;
+    mutator->until_sample = heap.sample_bytes > 0 ? sample_interval() : LONG_MAX;
+}
+
+/**
+ * Allocation the thread's current page has no room for, or of a large object, with the heap lock. It's a safepoint,
+ * where the thread's buffers are flushed: the heap's counts may then call for a collection or a step, which runs first.
+ * Then the object gets a new current page, or a mapping of its own.
+ */
+static struct ObjectHeader *alloc_slow(struct Mutator *mutator, size_t size) {
+    size_t cell_size = sizeof(struct ObjectHeader) + size;
+    lock_heap();
+    wait_world();
+    flush_mutator(mutator);
+    bool step = false, cycle = false, collection = false;
+    if (heap.incremental) {
+        if (heap.marking) {
+            if (cell_size > GC_MAX_CELL) heap.step_bytes += cell_size;
+            step = heap.step_bytes >= GC_STEP_BYTES && heap.step_budget > 0;
+            if (step) heap.step_bytes = 0;
+        } else {
+            cycle = heap.growth >= 0 && heap.bytes >= heap_limit(heap.major_bytes);
+        }
+    } else {
+        collection = heap.growth >= 0 && heap.bytes >= heap.trigger_bytes;
+    }
+    bool major = heap.live_bytes >= grown(heap.major_bytes);
+    unlock_heap();
+    if (step) gc_step(heap.step_budget);
+    if (cycle) start_cycle();
+    if (collection) run_collection(major, false);
+
+    lock_heap();
+    sync_sampling(mutator);
+    struct ObjectHeader *header;
+    if (cell_size > GC_MAX_CELL) {
+        header = large_alloc(size);
+    } else {
+        struct SizeClass *class = &heap.classes[heap.class_of[(cell_size - 1) / 16]];
+        // A collection may have made room in the current page.
+        struct Page *current = mutator->current[class - heap.classes];
+        header = current != NULL ? page_alloc(current) : NULL;
+        if (header == NULL) header = class_refill(mutator, class);
+        heap.bytes += class->cell_size;
+        heap.stats.total_allocated_bytes += class->cell_size;
+    }
+    heap.objects++;
+    unlock_heap();
+    return header;
+}
+
+void *gc_malloc(size_t size) {
+    const struct GCSite *site = gc_site;
+    gc_site = NULL;
+    if (!__atomic_load_n(&heap.ready, __ATOMIC_ACQUIRE)) heap_init();
+    // A collection is waiting for this task to park, or this thread to stop, and callers keep their GC values in stack
+    // frames across here.
+    if (__atomic_load_n(&safepoint_waiters, __ATOMIC_RELAXED) > 0) gc_safepoint_hook(false);
+    gc_safepoint();
+    struct Mutator *mutator = current_mutator;
+    current_stack->allocated = true;
+    size_t cell_size = sizeof(struct ObjectHeader) + size;
+
+    enter_heap();
+    struct ObjectHeader *header = NULL;
+    if (cell_size <= GC_MAX_CELL) {
+        struct Page *current = mutator->current[heap.class_of[(cell_size - 1) / 16]];
+        if (current != NULL && (header = page_alloc(current)) != NULL) {
+            mutator->bytes += current->cell_size;
+            mutator->objects++;
+        }
+    }
+    if (header == NULL) {
+        leave_heap();
+        header = alloc_slow(mutator, size);
+        enter_heap();
+    }
+    header->size = size;
+    mutator->until_sample -= (long) cell_size;
+    if (mutator->until_sample < 0) sample(mutator, header, site);
+    leave_heap();
+    return header + 1;
+}
+
+void *gc_malloc_typed(size_t size, const struct GCType *type) {
+    void *obj = gc_malloc(size);
+    gc_header(obj)->info |= (uintptr_t) type;
+    return obj;
+}
+
+
+
+void gc_scratch_init(struct GCScratch *scratch) {
+    scratch->buffer = NULL;
+    scratch->capacity = 0;
+}
+
+void *gc_scratch_alloc(struct GCScratch *scratch, size_t size) {
+    if (size > scratch->capacity) {
+        gc_scratch_free(scratch);
+        if (size <= sizeof scratch->inline_buffer) {
+            scratch->buffer = scratch->inline_buffer;
+            scratch->capacity = sizeof scratch->inline_buffer;
+        } else {
+            scratch->buffer = malloc(size);
+            if (scratch->buffer == NULL) {
+                perror("GC scratch allocation");
+                exit(1);
+            }
+            scratch->capacity = size;
+        }
+    }
+    return memset(scratch->buffer, 0, size);
+}
+
+void gc_scratch_free(struct GCScratch *scratch) {
+    if (scratch->buffer != scratch->inline_buffer) free(scratch->buffer);
+    gc_scratch_init(scratch);
+}
+
+static bool is_marked(const void *obj);
+
+static void unsample(void *obj);
+
+// With the heap lock. An object in the current page of another thread is left to the sweep, since that thread may be
+// allocating from the page.
+static void free_object(void *ptr) {
+    struct ObjectHeader *header = gc_header(ptr);
+    if (heap.marking && is_marked(ptr)) {
+        heap.deferred = reserve(heap.deferred, heap.deferred_count, &heap.deferred_capacity, sizeof(void *),
+                                "GC deferred frees");
+        heap.deferred[heap.deferred_count++] = ptr;
+        return;
+    }
+    if (is_large(header)) {
+        if (header->info & SAMPLED) unsample(ptr);
+        large_free(page_of(header));
+    } else {
+        struct Page *page = page_of(header);
+        uint32_t index = cell_index(page, header);
+        assert((page->allocated[index / 64] & (1UL << (index % 64))) && "Trying to free a non-gc owned pointer");
+        if (page->owner != NULL && page->owner != current_mutator) return;
+        if (header->info & SAMPLED) unsample(ptr);
+        heap.bytes -= page->cell_size;
+        free_cell(page, header, index);
+    }
+    heap.objects--;
+}
+
+void gc_free(void *ptr) {
+    lock_heap();
+    free_object(ptr);
+    unlock_heap();
+}
+
+// Whether addr points into an object that survived a collection.
+static bool in_old_object(const void *addr) {
+    struct Page *page = page_lookup(addr);
+    // Unused pages have no cells before bump.
+    if (page == NULL || (const char *) addr < page_cells(page) ||
+        (const char *) addr >= __atomic_load_n(&page->bump, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    uint32_t index = cell_index(page, addr);
+    uint64_t old = __atomic_load_n(&page->allocated[index / 64], __ATOMIC_RELAXED) &
+                   __atomic_load_n(&page->marks[index / 64], __ATOMIC_RELAXED);
+    return (old & (1UL << (index % 64))) != 0;
+}
+
+// In a program transformer.py generated, slots all have a type, so the branch always goes the same way.
+static void trace(struct Slot grey, struct MarkState *state) {
+    if (grey.type != NULL) {
+        if (grey.fn == (void (*)(void *, struct MarkState *)) gc_mark_ArrayType) {
+            gc_mark_ArrayType_typed(grey.slot, grey.type, state);
+        } else {
+            gc_mark_typed(grey.slot, grey.type, state);
+        }
+    } else {
+        grey.fn(grey.slot, state);
+    }
+}
+
+// Only the owner of a mark stack touches its top segment. Changing which segment is the top, or what's below it, takes
+// the marker's lock, since thieves take the segment below the top.
+static void push_grey(struct Slot grey, struct MarkState *state) {
+    struct StackSegment *top = state->grey;
+    if (top == NULL || top->count == GC_SEGMENT_SLOTS) {
+        struct StackSegment *segment = state->spare;
+        state->spare = NULL;
+        if (segment == NULL) segment = malloc(sizeof(struct StackSegment));
+        if (segment == NULL) {
+            trace(grey, state);
+            return;
+        }
+        segment->count = 0;
+        struct Marker *marker = (struct Marker *) state;
+        pthread_mutex_lock(&marker->lock);
+        segment->below = top;
+        state->grey = top = segment;
+        pthread_mutex_unlock(&marker->lock);
+    }
+    top->slots[top->count++] = grey;
+}
+
+static bool pop_grey(struct Slot *grey, struct MarkState *state) {
+    struct StackSegment *top = state->grey;
+    if (top == NULL) return false;
+    if (top->count == 0) {
+        // Only the owner adds segments, so once there are none below, there won't be until it pushes.
+        if (__atomic_load_n(&top->below, __ATOMIC_ACQUIRE) == NULL) return false;
+        struct Marker *marker = (struct Marker *) state;
+        pthread_mutex_lock(&marker->lock);
+        struct StackSegment *below = top->below;
+        if (below != NULL) state->grey = below;
+        pthread_mutex_unlock(&marker->lock);
+        if (below == NULL) return false;
+        free(state->spare);
+        state->spare = top;
+        top = below;
+    }
+    *grey = top->slots[--top->count];
+    return true;
+}
+
+// Takes the segment below the top of another marker's mark stack. The thief's own stack is empty.
+static bool steal(struct Marker *thief) {
+    for (int i = 1; i < pool.markers; i++) {
+        struct Marker *victim = &markers[(thief->id + i) % pool.markers];
+        pthread_mutex_lock(&victim->lock);
+        struct StackSegment *top = victim->state.grey;
+        struct StackSegment *segment = top != NULL ? top->below : NULL;
+        if (segment != NULL) __atomic_store_n(&top->below, segment->below, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&victim->lock);
+        if (segment == NULL) continue;
+
+        segment->below = NULL;
+        pthread_mutex_lock(&thief->lock);
+        free(thief->state.spare);
+        thief->state.spare = thief->state.grey;
+        thief->state.grey = segment;
+        pthread_mutex_unlock(&thief->lock);
+        return true;
+    }
+    return false;
+}
+
+// Moves the bottom half of the top segment to a segment of its own below it, where other markers can steal it.
+static void share_work(struct MarkState *state) {
+    struct StackSegment *top = state->grey;
+    if (top == NULL || top->count < GC_SHARE_MIN || __atomic_load_n(&top->below, __ATOMIC_ACQUIRE) != NULL) return;
+    struct StackSegment *segment = state->spare;
+    state->spare = NULL;
+    if (segment == NULL) segment = malloc(sizeof(struct StackSegment));
+    if (segment == NULL) return;
+    size_t half = top->count / 2;
+    memcpy(segment->slots, top->slots, half * sizeof(struct Slot));
+    memmove(top->slots, top->slots + half, (top->count - half) * sizeof(struct Slot));
+    segment->count = half;
+    segment->below = NULL;
+    top->count -= half;
+    struct Marker *marker = (struct Marker *) state;
+    pthread_mutex_lock(&marker->lock);
+    __atomic_store_n(&top->below, segment, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&marker->lock);
+}
+
+// Adds a slot to a remembered set, the heap's or a thread's, and returns the set.
+static struct Slot *remember(struct Slot *set, size_t *count, size_t *capacity, struct Slot written) {
+    // Stores in a row to the same slot, e.g. filling an array, are remembered once.
+    if (*count > 0) {
+        struct Slot *last = &set[*count - 1];
+        if (last->slot == written.slot && last->fn == written.fn && last->type == written.type) return set;
+    }
+    set = reserve(set, *count, capacity, sizeof(struct Slot), "GC remembered set");
+    set[(*count)++] = written;
+    return set;
+}
+
+// While marking, a marked object written to may already be traced, so it's traced again (incremental update). The
+// rest of the time, it's old, so it's remembered, by the thread until its next flush. Marking only starts and ends
+// while the threads are stopped, so it doesn't change under a running thread.
+static void write_barrier(struct Slot written) {
+    if (!in_old_object(written.slot)) {
+        return;
+    }
+    if (heap.marking) {
+        lock_heap();
+        push_grey(written, &markers[0].state);
+        unlock_heap();
+    } else {
+        struct Mutator *mutator = current_mutator;
+        enter_heap();
+        mutator->remembered = remember(mutator->remembered, &mutator->remembered_count, &mutator->remembered_capacity,
+                                       written);
+        leave_heap();
+    }
+}
+
+void gc_write_barrier(void *slot, void (*fn)(void *, struct MarkState *)) {
+    write_barrier((struct Slot) {slot, fn, NULL});
+}
+
+void gc_write_barrier_typed(void *slot, const struct GCType *type) {
+    write_barrier((struct Slot) {slot, NULL, type});
+}
+
+// Arrays set up by hand, with no capacity, have exactly len elements.
+static void settle_capacity(ArrayType *arr) {
+    if (arr->capacity < arr->len) arr->capacity = arr->len;
+}
+
+// Remembers the ArrayType arr, with the type of its elements if they have one, so their fields are traced too.
+static void array_barrier(ArrayType *arr, const struct GCType *element) {
+    write_barrier((struct Slot) {arr, (void (*)(void *, struct MarkState *)) gc_mark_ArrayType, element});
+}
+
+void gc_array_reserve_typed(ArrayType *arr, size_t capacity, const struct GCType *element) {
+    settle_capacity(arr);
+    if (capacity <= arr->capacity) return;
+    if (capacity < arr->capacity * 2) capacity = arr->capacity * 2;
+    if (capacity < 8) capacity = 8;
+    // The old buffer is left to the collector: other copies of the ArrayType may still use it.
+    void **grown = gc_malloc(capacity * sizeof(void *));
+    if (arr->len > 0) memcpy(grown, arr->arr, arr->len * sizeof(void *));
+    arr->arr = grown;
+    arr->capacity = capacity;
+    array_barrier(arr, element);
+}
+
+void gc_array_reserve(ArrayType *arr, size_t capacity) {
+    gc_array_reserve_typed(arr, capacity, NULL);
+}
+
+void gc_array_push_typed(ArrayType *arr, void *elem, const struct GCType *element) {
+    if (arr->len >= arr->capacity) gc_array_reserve_typed(arr, arr->len + 1, element);
+    arr->arr[arr->len++] = elem;
+    array_barrier(arr, element);
+}
+
+void gc_array_push(ArrayType *arr, void *elem) {
+    gc_array_push_typed(arr, elem, NULL);
+}
+
+void gc_array_splice_typed(ArrayType *arr, size_t index, size_t removed, void **items, size_t count,
+                           const struct GCType *element) {
+    assert(index <= arr->len && removed <= arr->len - index);
+    size_t len = arr->len - removed + count;
+    gc_array_reserve_typed(arr, len, element);
+    size_t tail = arr->len - index - removed;
+    if (tail > 0) memmove(arr->arr + index + count, arr->arr + index + removed, tail * sizeof(void *));
+    if (count > 0) memcpy(arr->arr + index, items, count * sizeof(void *));
+    // Slots the array shrank out of no longer keep their objects alive.
+    if (len < arr->len) memset(arr->arr + len, 0, (arr->len - len) * sizeof(void *));
+    arr->len = len;
+    if (count > 0) array_barrier(arr, element);
+}
+
+void gc_array_splice(ArrayType *arr, size_t index, size_t removed, void **items, size_t count) {
+    gc_array_splice_typed(arr, index, removed, items, count, NULL);
+}
+
+size_t gc_array_retain_if(ArrayType *arr, bool (*keep)(void *elem, size_t index, void *arg), void *arg) {
+    settle_capacity(arr);
+    size_t kept = 0;
+    // Elements only move towards the front of the buffer they're already in, so no barrier is needed.
+    for (size_t i = 0; i < arr->len; i++) {
+        if (keep(arr->arr[i], i, arg)) arr->arr[kept++] = arr->arr[i];
+    }
+    size_t removed = arr->len - kept;
+    if (removed > 0) memset(arr->arr + kept, 0, removed * sizeof(void *));
+    arr->len = kept;
+    return removed;
+}
+
+static bool is_marked(const void *obj) {
+    struct ObjectHeader *header = gc_header(obj);
+    struct Page *page = page_of(header);
+    uint32_t index = cell_index(page, header);
+    return (page->marks[index / 64] & (1UL << (index % 64))) != 0;
+}
+
+
+// Where an object is after the compacting collection running: it's moved the first time this is called for it, if
+// its page is evacuated, unless it was marked in place already.
+static void *evacuate(void *obj) {
+    struct ObjectHeader *header = gc_header(obj);
+    struct Page *page = page_of(header);
+    if (!page->evacuate) return obj;
+    if (forwarded(header) != NULL) return forwarded(header);
+    uint32_t index = cell_index(page, header);
+    if (page->marks[index / 64] & (1UL << (index % 64))) return obj;
+
+    struct SizeClass *class = class_of_page(page);
+    struct ObjectHeader *copy = class->evacuation_target != NULL ? page_alloc(class->evacuation_target) : NULL;
+    if (copy == NULL) {
+        class->evacuation_target = new_page(class);
+        copy = page_alloc(class->evacuation_target);
+    }
+    memcpy(copy, header, sizeof(struct ObjectHeader) + header->size);
+    header->info = (uintptr_t) (copy + 1) | FORWARDED;
+    // The old cell is counted as freed by the sweep.
+    heap.objects++;
+    heap.bytes += page->cell_size;
+    heap.stats.moved_bytes += page->cell_size;
+    return copy + 1;
+}
+
+bool gc_mark_plain(const void *obj, struct MarkState *state) {
+    if (obj == NULL) {
+        return false;
+    }
+    struct ObjectHeader *header = gc_header(obj);
+    struct Page *page = page_of(header);
+    // Marking an object that moved marks its copy. One that didn't is marked in place, and stays.
+    if (heap.evacuating && page->evacuate && forwarded(header) != NULL) {
+        header = gc_header(forwarded(header));
+        page = page_of(header);
+    }
+    uint32_t index = cell_index(page, header);
+    uint64_t bit = 1UL << (index % 64);
+    uint64_t *marks = &page->marks[index / 64];
+    if (__atomic_load_n(marks, __ATOMIC_RELAXED) & bit) {
+        return false;
+    }
+    if (heap.parallel) {
+        // Other markers set bits of the same word: only the one that set the bit traces the object.
+        if (__atomic_fetch_or(marks, bit, __ATOMIC_RELAXED) & bit) return false;
+    } else {
+        *marks |= bit;
+    }
+    state->marked++;
+    return true;
+}
+
+void gc_mark_object(const void *obj, void (*fn)(void *, struct MarkState *), struct MarkState *state) {
+    if (heap.evacuating && obj != NULL && page_of(gc_header(obj))->evacuate && forwarded(gc_header(obj)) != NULL) {
+        obj = forwarded(gc_header(obj));
+    }
+    if (gc_mark_plain(obj, state) && fn != NULL) {
+        push_grey((struct Slot) {(void *) obj, fn, NULL}, state);
+    }
+}
+
+// Marks the object *slot points to, moving it first if its page is evacuated, and makes it grey to be traced with the
+// function or type of traced, unless it has neither.
+static void mark_slot(void **slot, struct Slot traced, struct MarkState *state) {
+    void *obj = *slot;
+    if (heap.evacuating && obj != NULL) {
+        void *moved = evacuate(obj);
+        if (moved != obj) *slot = obj = moved;
+    }
+    if (gc_mark_plain(obj, state) && (traced.fn != NULL || traced.type != NULL)) {
+        traced.slot = obj;
+        push_grey(traced, state);
+    }
+}
+
+void gc_mark_pointer(void *slot, void (*fn)(void *, struct MarkState *), struct MarkState *state) {
+    mark_slot(slot, (struct Slot) {NULL, fn, NULL}, state);
+}
+
+static void mark_array(ArrayType *arr, struct Slot element, struct MarkState *state) {
+    if (arr != NULL) {
+        if (arr->arr != NULL) {
+            mark_slot((void **) &arr->arr, (struct Slot) {NULL, NULL, NULL}, state);
+            for (size_t i = 0; i < arr->len; i++) {
+                // Marking an element reads the header of its page.
+                if (i + GC_PREFETCH_DISTANCE < arr->len) {
+                    __builtin_prefetch(page_of(arr->arr[i + GC_PREFETCH_DISTANCE]));
+                }
+                mark_slot(&arr->arr[i], element, state);
+            }
+        }
+    }
+}
+
+void gc_mark_ArrayType1(ArrayType *arr, void (*fnptr)(void *, struct MarkState *), struct MarkState *state) {
+    mark_array(arr, (struct Slot) {NULL, fnptr, NULL}, state);
+}
+
+void gc_mark_ArrayType(ArrayType *arr, struct MarkState *state) {
+    gc_mark_ArrayType1(arr, NULL, state);
+}
+
+void gc_mark_ArrayType_typed(ArrayType *arr, const struct GCType *element, struct MarkState *state) {
+    mark_array(arr, (struct Slot) {NULL, NULL, element}, state);
+}
+
+void gc_mark_GCString(GCString *str, struct MarkState *state) {
+    gc_mark_pointer(str, NULL, state);
+}
+
+void gc_mark_typed(void *obj, const struct GCType *type, struct MarkState *state) {
+    if (obj == NULL) {
+        return;
+    }
+    if (type->mark != NULL) {
+        type->mark(obj, state);
+        return;
+    }
+    char *base = obj;
+    for (size_t i = 0; i < type->pointer_count; i++) {
+        const struct GCField *field = &type->pointers[i];
+        mark_slot((void **) (base + field->offset), (struct Slot) {NULL, NULL, field->type}, state);
+    }
+    for (size_t i = 0; i < type->array_count; i++) {
+        const struct GCField *field = &type->arrays[i];
+        mark_array((ArrayType *) (base + field->offset), (struct Slot) {NULL, NULL, field->type}, state);
+    }
+    // Structs only nest as deep as their declarations, so this doesn't recurse far.
+    for (size_t i = 0; i < type->struct_count; i++) {
+        gc_mark_typed(base + type->structs[i].offset, type->structs[i].type, state);
+    }
+}
+
+// The GC values of the runtime are a pointer to an object without pointers, or an array of them.
+static const struct GCField untyped_field[] = {{0, NULL}};
+
+const struct GCType gc_type_ArrayType = {.size = sizeof(ArrayType), .array_count = 1, .arrays = untyped_field};
+const struct GCType gc_type_GCString = {.size = sizeof(GCString), .pointer_count = 1, .pointers = untyped_field};
+const struct GCType gc_type_GCDouble = {.size = sizeof(GCDouble), .pointer_count = 1, .pointers = untyped_field};
+const struct GCType gc_type_GCInt = {.size = sizeof(GCInt), .pointer_count = 1, .pointers = untyped_field};
+const struct GCType gc_type_GCPointer = {.size = sizeof(GCPointer), .pointer_count = 1, .pointers = untyped_field};
+const struct GCType gc_type_NoPointers = {0};
+
+
+static uint32_t page_words(struct Page *page) {
+    return (cell_index(page, page->bump) + 63) / 64;
+}
+
+// Frees the allocated cells of a page that aren't marked, going through its bitmaps a word at a time. Returns the
+// number of cells freed.
+static uint32_t sweep_page(struct Page *page) {
+    uint32_t freed = 0;
+    uint32_t words = page_words(page);
+    for (uint32_t word = 0; word < words; word++) {
+        uint64_t dead = page->allocated[word] & ~page->marks[word];
+        for (; dead != 0; dead &= dead - 1) {
+            uint32_t index = word * 64 + __builtin_ctzl(dead);
+            free_cell(page, page_cells(page) + (size_t) index * page->cell_size, index);
+            freed++;
+        }
+    }
+    return freed;
+}
+
+static bool page_unmarked(struct Page *page) {
+    uint32_t words = page_words(page);
+    for (uint32_t word = 0; word < words; word++) {
+        if (page->marks[word] != 0) return false;
+    }
+    return true;
+}
+
+// Frees the unmarked objects of a page, and adds how many to freed. If none are left, only zeroes the cells that were
+// in use, and returns true: the page is to be released.
+static bool sweep_cells(struct Page *page, size_t *freed) {
+    if (page_unmarked(page)) {
+        *freed += page->live;
+        char *cells = page_cells(page);
+        memset(cells, 0, page->bump - cells);
+        return true;
+    }
+    *freed += sweep_page(page);
+    return false;
+}
+
+// Sweeps a page a collection left unswept. Returns true if it was released.
+static bool sweep_lazily(struct Page *page) {
+    size_t freed = 0;
+    bool empty = sweep_cells(page, &freed);
+    heap.objects -= freed;
+    heap.bytes -= freed * page->cell_size;
+    heap.live_bytes -= freed * page->cell_size;
+    heap.trigger_bytes = heap_limit(heap.live_bytes);
+    if (page->unswept == SWEEP_MAJOR) heap.major_bytes -= freed * page->cell_size;
+    page->unswept = 0;
+    heap.unswept_pages--;
+    if (empty) release_page(page);
+    return empty;
+}
+
+static void add_empty(struct Marker *marker, struct Page *page) {
+    marker->empty = reserve(marker->empty, marker->empty_count, &marker->empty_capacity, sizeof(struct Page *),
+                            "GC sweep");
+    marker->empty[marker->empty_count++] = page;
+}
+
+// Frees the unmarked objects of the pages the marker claims. Pages left without objects, and dead large objects, only
+// touch page lists, so they're freed afterwards by gc_find_unused().
+static void sweep_job(struct Marker *marker) {
+    for (;;) {
+        size_t first = __atomic_fetch_add(&heap.sweep_next, GC_SWEEP_BATCH, __ATOMIC_RELAXED);
+        if (first >= heap.sweep_count) return;
+        size_t last = first + GC_SWEEP_BATCH < heap.sweep_count ? first + GC_SWEEP_BATCH : heap.sweep_count;
+        for (size_t i = first; i < last; i++) {
+            struct Page *page = heap.sweep_pages[i];
+            if (page->mapped != 0) {
+                if (page->marks[0] == 0) add_empty(marker, page);
+                continue;
+            }
+            size_t freed = 0;
+            if (sweep_cells(page, &freed)) add_empty(marker, page);
+            marker->freed += freed;
+            marker->freed_bytes += freed * page->cell_size;
+        }
+    }
+}
+
+// Before a major collection, every object is young again. Unswept pages are left to its sweep.
+// With conservative roots, pages left unswept are swept first: their dead objects would look allocated once unmarked,
+// and a stale word on a stack could revive one whose pointers lead to cells freed since.
+static void clear_marks() {
+    for (size_t i = 0; i < GC_SIZE_CLASSES; i++) {
+        for (struct Page *page = heap.classes[i].pages, *next; page != NULL; page = next) {
+            next = page->next;
+            if (heap.conservative && page->unswept != 0 && sweep_lazily(page)) continue;
+            memset(page->marks, 0, page_words(page) * sizeof(uint64_t));
+            page->unswept = 0;
+        }
+    }
+    heap.unswept_pages = 0;
+    for (struct Page *page = heap.large; page != NULL; page = page->next) {
+        page->marks[0] = 0;
+    }
+}
+
+bool gc_verbose = true;
+
+/**
+ * Frees every object that wasn't marked. A major collection sweeps every page, a minor one only the nursery: the
+ * other pages only hold old objects, which stay marked. Pages left without objects go back to the unused pages.
+ * Afterwards, the nursery starts over from the current pages.
+ */
+static void run_parallel(void (*job)(struct Marker *));
+
+// With lazy sweeping, only large objects are swept right away.
+static void add_sweep_page(struct Page *page, bool major) {
+    if (heap.lazy_sweep && page->mapped == 0) {
+        // A page left unswept by the last minor collection isn't in the nursery, so only a major one finds it again.
+        if (page->unswept == 0) heap.unswept_pages++;
+        page->unswept = major ? SWEEP_MAJOR : SWEEP_MINOR;
+        return;
+    }
+    heap.sweep_pages = reserve(heap.sweep_pages, heap.sweep_count, &heap.sweep_capacity, sizeof(struct Page *),
+                               "GC sweep");
+    heap.sweep_pages[heap.sweep_count++] = page;
+}
+
+static void prune_samples();
+
+static void gc_find_unused(bool major) {
+    prune_samples();
+    heap.sweep_count = 0;
+    heap.sweep_next = 0;
+    if (major) {
+        // Mappings nothing reused since the last major collection go back to the kernel, so the cache only holds on to
+        // memory the program is still churning through.
+        large_cache_release();
+        for (size_t i = 0; i < GC_SIZE_CLASSES; i++) {
+            for (struct Page *page = heap.classes[i].pages; page != NULL; page = page->next) add_sweep_page(page, true);
+        }
+        for (struct Page *page = heap.large; page != NULL; page = page->next) add_sweep_page(page, true);
+    } else {
+        for (size_t i = 0; i < heap.young_count; i++) add_sweep_page(heap.young[i], false);
+    }
+    for (int i = 0; i < pool.threads; i++) {
+        markers[i].freed = markers[i].freed_bytes = markers[i].empty_count = 0;
+    }
+    run_parallel(sweep_job);
+
+    size_t deadcount = 0;
+    for (int i = 0; i < pool.threads; i++) {
+        struct Marker *marker = &markers[i];
+        deadcount += marker->freed;
+        heap.bytes -= marker->freed_bytes;
+        for (size_t j = 0; j < marker->empty_count; j++) {
+            struct Page *page = marker->empty[j];
+            if (page->mapped != 0) {
+                large_free(page);
+                deadcount++;
+            } else {
+                release_page(page);
+            }
+        }
+    }
+    heap.objects -= deadcount;
+
+    for (size_t i = 0; i < heap.young_count; i++) {
+        heap.young[i]->young = false;
+    }
+    heap.young_count = 0;
+    heap.remembered_count = 0;
+    for (struct Mutator *mutator = heap.mutators; mutator != NULL; mutator = mutator->next) {
+        for (size_t i = 0; i < GC_SIZE_CLASSES; i++) {
+            struct Page *page = mutator->current[i];
+            if (page == NULL) continue;
+            // An unswept page is swept before allocating from it again, once class_refill() gets to it.
+            if (page->unswept != 0) {
+                page->owner = NULL;
+                mutator->current[i] = NULL;
+            } else {
+                add_young(page);
+            }
+        }
+    }
+    // Freed cells can be anywhere, so look for room from the first page again.
+    for (size_t i = 0; i < GC_SIZE_CLASSES; i++) heap.classes[i].cursor = heap.classes[i].pages;
+    if (major) heap.major_bytes = heap.bytes;
+    heap.live_bytes = heap.bytes;
+    heap.trigger_bytes = heap_limit(heap.live_bytes);
+    heap.stats.collections++;
+    if (major) heap.stats.major_collections++;
+
+    if (gc_verbose && heap.lazy_sweep) {
+        printf("%s collection. Dead count: %zu; Livecount: %zu; Unswept pages: %zu\n", major ? "Major" : "Minor",
+               deadcount, heap.objects, heap.unswept_pages);
+    } else if (gc_verbose) {
+        printf("%s collection. Dead count: %zu; Livecount: %zu\n", major ? "Major" : "Minor", deadcount,
+               heap.objects);
+    }
+
+}
+
+void (*gc_pause_hook)(long ns);
+
+static long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void pause_end(long start) {
+    long ns = now_ns() - start;
+    heap.stats.total_pause_ns += ns;
+    if (gc_pause_hook != NULL) gc_pause_hook(ns);
+}
+
+static void scan_object(void *obj, struct MarkState *state);
+
+/**
+ * Marks the object word points into, if any: the page map tells whether it's in the heap, and the page which cell.
+ * Interior pointers count, but not ones to free cells, nor (in a minor collection) to dead cells of a page left
+ * unswept. The object is traced with the type in its header, or scanned conservatively like a stack if it has none.
+ *
+ * An untyped object found from a stack is scanned even if it's old, in a minor collection: it may be the buffer of an
+ * ArrayType local, which transformer.py emits no write barrier for, since stack frames are traced every time.
+ */
+static void mark_ambiguous(uintptr_t word, bool stack, struct MarkState *state) {
+    struct Page *page = page_lookup((void *) word);
+    if (page == NULL || (char *) word < page_cells(page) || (char *) word >= page->bump) return;
+    uint32_t index = cell_index(page, (void *) word);
+    uint64_t bit = 1UL << (index % 64);
+    if (!(page->allocated[index / 64] & bit) || (page->unswept != 0 && !(page->marks[index / 64] & bit))) return;
+    struct ObjectHeader *header = (struct ObjectHeader *) (page_cells(page) + (size_t) index * page->cell_size);
+    const struct GCType *type = (const struct GCType *) (header->info & ~SAMPLED);
+    bool unmarked = gc_mark_plain(header + 1, state);
+    if (type != &gc_type_NoPointers && (unmarked || (stack && type == NULL && heap.mark_remembered))) {
+        push_grey((struct Slot) {header + 1, type == NULL ? scan_object : NULL, type}, state);
+    }
+}
+
+// Stacks hold anything, including the redzones of the address sanitizer.
+__attribute__((no_sanitize_address))
+static void scan_words(const void *start, const void *end, bool stack, struct MarkState *state) {
+    const uintptr_t *word = (const uintptr_t *) (((uintptr_t) start + sizeof(uintptr_t) - 1) & -sizeof(uintptr_t));
+    for (; word + 1 <= (const uintptr_t *) end; word++) {
+        mark_ambiguous(*word, stack, state);
+    }
+}
+
+static void scan_range(const void *start, const void *end, struct MarkState *state) {
+    scan_words(start, end, true, state);
+}
+
+static void scan_object(void *obj, struct MarkState *state) {
+    scan_words(obj, (char *) obj + gc_header(obj)->size, false, state);
+}
+
+void (*gc_scan_stacks_hook)(const void *sp, void (*scan)(const void *start, const void *end, struct MarkState *state),
+                            struct MarkState *state);
+
+// Callee-saved registers may hold pointers too: __builtin_unwind_init() spills them into this frame, which is scanned
+// with the callers'.
+__attribute__((noinline))
+static void scan_stacks(struct MarkState *state) {
+    __builtin_unwind_init();
+    const char *sp = __builtin_frame_address(0);
+    if (sp >= heap.stack_low && sp < heap.stack_top) scan_range(sp, heap.stack_top, state);
+    if (gc_scan_stacks_hook != NULL) gc_scan_stacks_hook(sp, scan_range, state);
+}
+
+// Marks the frames of every shadow stack of every thread, from the first-th one on, every stride-th one. The first
+// marker also scans the stacks, with conservative roots. Before anything else: their objects must be marked before a
+// compacting collection could move them.
+static void mark_roots(struct MarkState *state, size_t first, size_t stride) {
+    if (heap.conservative && first == 0) scan_stacks(state);
+    for (struct Mutator *mutator = heap.mutators; mutator != NULL; mutator = mutator->next) {
+        for (struct GCShadowStack *stack = &mutator->stack; stack != NULL; stack = stack->next) {
+            for (size_t i = first; i < stack->count; i += stride) {
+                void *frame = stack->frames[i];
+                struct StackMap *entry = &STACK_MAP[*(int *) frame];
+                trace((struct Slot) {frame, entry->fn_ptr, entry->type}, state);
+            }
+        }
+    }
+}
+
+/**
+ * Traces grey objects until none are left, or budget objects were marked. Returns true if none are left.
+ * Objects popped off the mark stack go through a FIFO of GC_PREFETCH_DISTANCE before they're traced. They're prefetched
+ * when they enter it, so tracing them doesn't wait for memory.
+ */
+static bool drain(struct MarkState *state, size_t budget) {
+    struct Slot fifo[GC_PREFETCH_DISTANCE];
+    size_t head = 0, count = 0, traced = 0;
+    int start = state->marked;
+    for (;;) {
+        struct Slot grey;
+        if (heap.parallel && ++traced % GC_SHARE_INTERVAL == 0 &&
+            __atomic_load_n(&pool.active, __ATOMIC_RELAXED) < pool.markers) {
+            share_work(state);
+        }
+        while (count < GC_PREFETCH_DISTANCE && pop_grey(&grey, state)) {
+            __builtin_prefetch(grey.slot);
+            fifo[(head + count++) % GC_PREFETCH_DISTANCE] = grey;
+        }
+        if (count == 0) return true;
+        if ((size_t) (state->marked - start) >= budget) {
+            while (count > 0) {
+                grey = fifo[(head + --count) % GC_PREFETCH_DISTANCE];
+                push_grey(grey, state);
+            }
+            return false;
+        }
+        grey = fifo[head];
+        head = (head + 1) % GC_PREFETCH_DISTANCE;
+        count--;
+        trace(grey, state);
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct Marker *marker = arg;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (marker->job_id == pool.job_id) pthread_cond_wait(&pool.wake, &pool.lock);
+        marker->job_id = pool.job_id;
+        void (*job)(struct Marker *) = pool.job;
+        bool working = marker->id < pool.threads;
+        pthread_mutex_unlock(&pool.lock);
+        if (working) job(marker);
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.running == 0) pthread_cond_signal(&pool.done);
+    }
+    return NULL;
+}
+
+// Runs job on the markers of every thread, markers[0] on this one, and waits for all of them.
+static void run_parallel(void (*job)(struct Marker *)) {
+    if (pool.threads == 1) {
+        job(&markers[0]);
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.job = job;
+    pool.job_id++;
+    pool.running = pool.started;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    job(&markers[0]);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.running > 0) pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void gc_set_threads(int threads) {
+    if (!__atomic_load_n(&heap.ready, __ATOMIC_ACQUIRE)) heap_init();
+    if (threads < 1) threads = 1;
+    if (threads > GC_MAX_THREADS) threads = GC_MAX_THREADS;
+    // Workers block every signal, so that the scheduler's SIGALRM (runtime.c) only interrupts the program's thread.
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    for (; pool.started < threads - 1; pool.started++) {
+        struct Marker *marker = &markers[pool.started + 1];
+        marker->job_id = pool.job_id;
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, worker_main, marker);
+        if (error != 0) {
+            fprintf(stderr, "GC worker thread: %s\n", strerror(error));
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    pool.threads = threads;
+}
+
+/**
+ * Each marker marks its share of the roots, then traces until it runs out of grey objects. Then it steals some from
+ * the others, until none of them have any: a marker only counts as inactive while its stack is empty and it isn't
+ * stealing, so there's no grey object left once no marker is active.
+ *
+ * A minor collection doesn't trace old objects, so the young objects they point to are found through the slots they
+ * were stored in. If a remembered object was freed since, its cell is either free or holds a young object, which needs
+ * no help.
+ */
+static void mark_job(struct Marker *marker) {
+    struct MarkState *state = &marker->state;
+    mark_roots(state, marker->id, pool.markers);
+    if (heap.mark_remembered) {
+        for (size_t i = marker->id; i < heap.remembered_count; i += pool.markers) {
+            struct Slot *remembered = &heap.remembered[i];
+            if (in_old_object(remembered->slot)) trace(*remembered, state);
+        }
+    }
+    for (;;) {
+        drain(state, SIZE_MAX);
+        __atomic_fetch_sub(&pool.active, 1, __ATOMIC_ACQ_REL);
+        for (;;) {
+            if (__atomic_load_n(&pool.active, __ATOMIC_ACQUIRE) == 0) return;
+            __atomic_fetch_add(&pool.active, 1, __ATOMIC_ACQ_REL);
+            if (steal(marker)) break;
+            __atomic_fetch_sub(&pool.active, 1, __ATOMIC_ACQ_REL);
+            sched_yield();
+        }
+    }
+}
+
+// Marks everything reachable from the roots (and the remembered set, for a minor collection) on every thread. Grey
+// objects left by an incremental cycle are on the stack of markers[0].
+static void mark(bool minor) {
+    heap.mark_remembered = minor;
+    // Two markers could both copy an object, so a compacting collection marks on this thread only.
+    pool.markers = heap.evacuating ? 1 : pool.threads;
+    pool.active = pool.markers;
+    if (pool.markers == 1) {
+        mark_job(&markers[0]);
+        return;
+    }
+    heap.parallel = true;
+    run_parallel(mark_job);
+    heap.parallel = false;
+}
+
+// Picks the pages a compacting collection evacuates. Current pages are left alone, since allocation goes on in them.
+static void select_evacuated() {
+    heap.evacuated_count = 0;
+    for (size_t i = 0; i < GC_SIZE_CLASSES; i++) {
+        struct SizeClass *class = &heap.classes[i];
+        for (struct Page *page = class->pages; page != NULL; page = page->next) {
+            size_t cells = (page->end - page_cells(page)) / page->cell_size;
+            if (page->owner != NULL || (size_t) page->live * 100 >= cells * GC_EVACUATE_OCCUPANCY) continue;
+            page->evacuate = true;
+            heap.evacuated = reserve(heap.evacuated, heap.evacuated_count, &heap.evacuated_capacity,
+                                     sizeof(struct Page *), "GC compaction");
+            heap.evacuated[heap.evacuated_count++] = page;
+        }
+    }
+}
+
+// Evacuated pages the sweep released are zeroes already. The others hold objects marked in place, or are unswept.
+static void end_evacuation() {
+    for (size_t i = 0; i < heap.evacuated_count; i++) heap.evacuated[i]->evacuate = false;
+    heap.evacuated_count = 0;
+    for (size_t i = 0; i < GC_SIZE_CLASSES; i++) heap.classes[i].evacuation_target = NULL;
+    heap.evacuating = false;
+}
+
+static void collect(bool major, bool compact) {
+    long start = now_ns();
+    if (major) clear_marks();
+    if (compact) {
+        select_evacuated();
+        heap.evacuating = true;
+    }
+    mark(!major);
+    long marked = now_ns();
+    gc_find_unused(major);
+    if (compact) end_evacuation();
+    heap.stats.last_mark_ns = marked - start;
+    heap.stats.last_sweep_ns = now_ns() - marked;
+}
+
+static void start_cycle() {
+    safepoint();
+    lock_heap();
+    wait_world();
+    // Another task or thread may have started one while this one waited.
+    if (!heap.marking) {
+        stop_world();
+        long start = now_ns();
+        clear_marks();
+        heap.remembered_count = 0;
+        heap.marking = true;
+        heap.step_bytes = 0;
+        mark_roots(&markers[0].state, 0, 1);
+        pause_end(start);
+        resume_world();
+    }
+    unlock_heap();
+}
+
+// Stack frames have no write barrier, so they're marked again before sweeping.
+static void finish_cycle() {
+    long start = now_ns();
+    mark(false);
+    heap.marking = false;
+    long marked = now_ns();
+    gc_find_unused(true);
+    heap.stats.last_mark_ns = marked - start;
+    heap.stats.last_sweep_ns = now_ns() - marked;
+    for (size_t i = 0; i < heap.deferred_count; i++) {
+        free_object(heap.deferred[i]);
+    }
+    heap.deferred_count = 0;
+}
+
+static void update_profile();
+
+bool gc_step(size_t budget) {
+    if (!heap.marking) return false;
+    safepoint();
+    lock_heap();
+    wait_world();
+    if (heap.marking) {
+        stop_world();
+        long start = now_ns();
+        if (drain(&markers[0].state, budget)) finish_cycle();
+        pause_end(start);
+        resume_world();
+    }
+    bool marking = heap.marking;
+    unlock_heap();
+    update_profile();
+    return marking;
+}
+
+void gc_set_lazy_sweep(bool lazy) {
+    heap.lazy_sweep = lazy;
+}
+
+void gc_set_growth(int percent) {
+    heap.growth = percent;
+    heap.trigger_bytes = heap_limit(heap.live_bytes);
+}
+
+void gc_set_incremental(bool incremental, size_t step_budget) {
+    heap.incremental = incremental;
+    heap.step_budget = step_budget;
+}
+
+/**
+ * Finishes the cycle in progress, if there's one, or collects. Only collections the program asked for compact, and
+ * only with a single thread: the others may hold pointers outside of stack frames at the safepoint they stopped at.
+ * A collection allocation triggered doesn't happen if another thread collected while this one waited.
+ */
+static void run_collection(bool major, bool requested) {
+    safepoint();
+    lock_heap();
+    wait_world();
+    if (requested || heap.bytes >= heap.trigger_bytes) {
+        stop_world();
+        long start = now_ns();
+        if (heap.marking) {
+            finish_cycle();
+        } else {
+            collect(major, requested && major && heap.compaction && !heap.conservative && heap.threads == 1);
+        }
+        pause_end(start);
+        resume_world();
+    }
+    unlock_heap();
+    update_profile();
+}
+
+void gc_run() {
+    run_collection(heap.live_bytes >= grown(heap.major_bytes), true);
+}
+
+void gc_run_major() {
+    run_collection(true, true);
+}
+
+void gc_set_compaction(bool compaction) {
+    heap.compaction = compaction;
+}
+
+void gc_set_conservative(bool conservative) {
+    if (conservative && heap.stack_top == NULL) {
+        pthread_attr_t attr;
+        void *low;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr) != 0 || pthread_attr_getstack(&attr, &low, &size) != 0) {
+            fprintf(stderr, "GC conservative roots: can't find the stack\n");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+        heap.stack_low = low;
+        heap.stack_top = (char *) low + size;
+    }
+    heap.conservative = conservative;
+}
+
+void gc_get_stats(struct GCStats *stats) {
+    lock_heap();
+    flush_mutator(current_mutator);
+    *stats = heap.stats;
+    stats->heap_bytes = heap.bytes;
+    stats->live_bytes = heap.live_bytes;
+    unlock_heap();
+}
+
+// Exponentially distributed, with a mean of sample_bytes, so the objects sampled don't follow allocation patterns.
+static long sample_interval() {
+    uint64_t x = heap.sample_random;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    heap.sample_random = x;
+    double uniform = (double) ((x * 0x2545f4914f6cdd1dUL) >> 11) / (double) (1UL << 53);
+    return (long) (-log(1.0 - uniform) * (double) heap.sample_bytes);
+}
+
+static void sample(struct Mutator *mutator, struct ObjectHeader *header, const struct GCSite *site) {
+    size_t cell_size = sizeof(struct ObjectHeader) + header->size;
+    lock_heap();
+    mutator->until_sample = sample_interval();
+    header->info |= SAMPLED;
+    double weight = 1.0 / (1.0 - exp(-(double) cell_size / (double) heap.sample_bytes));
+    // Programs have a handful of sites, and only one allocation in sample_bytes gets here.
+    size_t index = 0;
+    while (index < heap.profile_site_count && heap.profile_sites[index].site != site) index++;
+    if (index == heap.profile_site_count) {
+        heap.profile_sites = reserve(heap.profile_sites, heap.profile_site_count, &heap.profile_site_capacity,
+                                     sizeof(struct ProfileSite), "GC heap profile");
+        heap.profile_sites[heap.profile_site_count++] = (struct ProfileSite) {site, 0, 0};
+    }
+    heap.profile_sites[index].allocated_objects += weight;
+    heap.profile_sites[index].allocated_bytes += weight * (double) header->size;
+    heap.samples = reserve(heap.samples, heap.sample_count, &heap.sample_capacity, sizeof(struct Sample),
+                           "GC heap profile");
+    heap.samples[heap.sample_count++] = (struct Sample) {header + 1, index, weight};
+    unlock_heap();
+}
+
+static void unsample(void *obj) {
+    for (size_t i = 0; i < heap.sample_count; i++) {
+        if (heap.samples[i].obj == obj) {
+            heap.samples[i] = heap.samples[--heap.sample_count];
+            return;
+        }
+    }
+}
+
+// Once marking is done, before the sweep: unmarked samples are dead, and evacuated ones moved.
+static void prune_samples() {
+    size_t kept = 0;
+    for (size_t i = 0; i < heap.sample_count; i++) {
+        struct Sample sample = heap.samples[i];
+        struct ObjectHeader *header = gc_header(sample.obj);
+        if (heap.evacuating && page_of(header)->evacuate && forwarded(header) != NULL) {
+            sample.obj = forwarded(header);
+        }
+        if (is_marked(sample.obj)) heap.samples[kept++] = sample;
+    }
+    heap.sample_count = kept;
+    heap.profile_stale = heap.profile_path != NULL;
+}
+
+// Other threads pick up sample_bytes when they next take the heap lock to allocate.
+void gc_set_profile(size_t sample_bytes, const char *path) {
+    lock_heap();
+    heap.sample_bytes = sample_bytes;
+    heap.profile_path = path;
+    sync_sampling(current_mutator);
+    unlock_heap();
+}
+
+/**
+ * The profile is a protocol buffer (profile.proto of github.com/google/pprof), which pprof reads uncompressed too.
+ * Messages are built in a Proto each, since a nested message is written after its length.
+ */
+struct Proto {
+    uint8_t *data;
+    size_t count, capacity;
+};
+
+static void proto_byte(struct Proto *proto, uint8_t byte) {
+    proto->data = reserve(proto->data, proto->count, &proto->capacity, 1, "GC heap profile");
+    proto->data[proto->count++] = byte;
+}
+
+static void proto_varint(struct Proto *proto, uint64_t value) {
+    for (; value >= 0x80; value >>= 7) proto_byte(proto, (uint8_t) (value | 0x80));
+    proto_byte(proto, (uint8_t) value);
+}
+
+// A varint field. Zero is the default, so it's left out.
+static void proto_int(struct Proto *proto, int field, uint64_t value) {
+    if (value == 0) return;
+    proto_varint(proto, (uint64_t) field << 3);
+    proto_varint(proto, value);
+}
+
+static void proto_bytes(struct Proto *proto, int field, const void *bytes, size_t count) {
+    proto_varint(proto, (uint64_t) field << 3 | 2);
+    proto_varint(proto, count);
+    for (size_t i = 0; i < count; i++) proto_byte(proto, ((const uint8_t *) bytes)[i]);
+}
+
+// Writes message as a field of proto, and empties it for the next one.
+static void proto_message(struct Proto *proto, int field, struct Proto *message) {
+    proto_bytes(proto, field, message->data, message->count);
+    message->count = 0;
+}
+
+// The index of a string in the string table, which it's added to the first time.
+struct Strings {
+    const char **strings;
+    size_t count, capacity;
+};
+
+static uint64_t string_index(struct Strings *table, const char *string) {
+    for (size_t i = 0; i < table->count; i++) {
+        if (strcmp(table->strings[i], string) == 0) return i;
+    }
+    table->strings = reserve(table->strings, table->count, &table->capacity, sizeof(char *), "GC heap profile");
+    table->strings[table->count] = string;
+    return table->count++;
+}
+
+/**
+ * Sample types, like Go's heap profiles: objects and bytes allocated since the program started, and in use. Every site
+ * is a sample with one location, whose function is the one the site is in, labelled with the type it allocates.
+ * Location and function ids are the site's index, plus one.
+ */
+static void encode_profile(struct Proto *profile) {
+    struct Strings strings = {0};
+    struct Proto message = {0}, inner = {0};
+    string_index(&strings, "");
+    const char *types[][2] = {{"alloc_objects", "count"}, {"alloc_space", "bytes"},
+                              {"inuse_objects", "count"}, {"inuse_space", "bytes"}};
+    for (int i = 0; i < 4; i++) {
+        proto_int(&message, 1, string_index(&strings, types[i][0]));
+        proto_int(&message, 2, string_index(&strings, types[i][1]));
+        proto_message(profile, 1, &message);
+    }
+
+    double *in_use = calloc(2 * heap.profile_site_count + 1, sizeof(double));
+    if (in_use == NULL) {
+        perror("GC heap profile");
+        exit(1);
+    }
+    for (size_t i = 0; i < heap.sample_count; i++) {
+        struct Sample *sample = &heap.samples[i];
+        in_use[2 * sample->site] += sample->weight;
+        in_use[2 * sample->site + 1] += sample->weight * (double) gc_header(sample->obj)->size;
+    }
+    for (size_t i = 0; i < heap.profile_site_count; i++) {
+        struct ProfileSite *site = &heap.profile_sites[i];
+        proto_varint(&inner, i + 1);
+        proto_message(&message, 1, &inner);
+        double values[] = {site->allocated_objects, site->allocated_bytes, in_use[2 * i], in_use[2 * i + 1]};
+        for (int j = 0; j < 4; j++) proto_varint(&inner, (uint64_t) (values[j] + 0.5));
+        proto_message(&message, 2, &inner);
+        proto_int(&inner, 1, string_index(&strings, "type"));
+        proto_int(&inner, 2, string_index(&strings, site->site != NULL ? site->site->type : "?"));
+        proto_message(&message, 3, &inner);
+        proto_message(profile, 2, &message);
+    }
+    free(in_use);
+
+    for (size_t i = 0; i < heap.profile_site_count; i++) {
+        const struct GCSite *site = heap.profile_sites[i].site;
+        proto_int(&message, 1, i + 1);
+        proto_int(&inner, 1, i + 1);
+        proto_int(&inner, 2, site != NULL ? site->line : 0);
+        proto_message(&message, 4, &inner);
+        proto_message(profile, 4, &message);
+    }
+    for (size_t i = 0; i < heap.profile_site_count; i++) {
+        const struct GCSite *site = heap.profile_sites[i].site;
+        uint64_t name = string_index(&strings, site != NULL ? site->function : "(unknown)");
+        proto_int(&message, 1, i + 1);
+        proto_int(&message, 2, name);
+        proto_int(&message, 3, name);
+        proto_int(&message, 4, string_index(&strings, site != NULL ? site->file : ""));
+        proto_message(profile, 5, &message);
+    }
+
+    // The period is in the string table too, so it's written before it.
+    proto_int(&message, 1, string_index(&strings, "space"));
+    proto_int(&message, 2, string_index(&strings, "bytes"));
+    proto_message(profile, 11, &message);
+    proto_int(profile, 12, heap.sample_bytes);
+    proto_int(profile, 14, string_index(&strings, "inuse_space"));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    proto_int(profile, 9, (uint64_t) now.tv_sec * 1000000000UL + (uint64_t) now.tv_nsec);
+    for (size_t i = 0; i < strings.count; i++) proto_bytes(profile, 6, strings.strings[i], strlen(strings.strings[i]));
+    free(strings.strings);
+    free(message.data);
+    free(inner.data);
+}
+
+bool gc_write_profile(const char *path) {
+    struct Proto profile = {0};
+    lock_heap();
+    encode_profile(&profile);
+    unlock_heap();
+    FILE *file = fopen(path, "wb");
+    bool written = file != NULL && fwrite(profile.data, 1, profile.count, file) == profile.count;
+    if (file != NULL && fclose(file) != 0) written = false;
+    free(profile.data);
+    return written;
+}
+
+// Outside of the pause: the profile of the collection that just ended replaces the previous one.
+static void update_profile() {
+    lock_heap();
+    bool stale = heap.profile_stale;
+    heap.profile_stale = false;
+    unlock_heap();
+    if (stale && !gc_write_profile(heap.profile_path)) perror(heap.profile_path);
+}
@@ -0,0 +1,390 @@
+#ifndef P1_GC_RUNTIME_H
+#define P1_GC_RUNTIME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef double *GCDouble;
+typedef char *GCString;
+typedef void *GCPointer;
+typedef int *GCInt;
+typedef struct {
+    void **arr;
+    size_t len;
+    size_t capacity;
+} ArrayType;
+
+struct StackSegment;
+
+// State of one collection's marking on one thread, passed to every gc_mark_* function.
+struct MarkState {
+    // Number of objects marked so far, i.e. found live.
+    int marked;
+    // The thread's mark stack: its top segment, and an empty one kept for when the stack grows again, so a stack going
+    // back and forth over a segment boundary doesn't allocate every time.
+    struct StackSegment *grey;
+    struct StackSegment *spare;
+};
+
+// A field of a struct that holds GC values: its offset, and the type of what it holds.
+struct GCField {
+    size_t offset;
+    const struct GCType *type;
+};
+
+/**
+ * Layout of a struct, for marking. transformer.py generates one per user struct and stack frame, gc_type_<name>, as
+ * tables rather than code: marking interprets them in one loop (gc_mark_typed()) instead of calling a marking function
+ * per object.
+ */
+struct GCType {
+    size_t size;
+    // Pointers to GC objects, and the type of the objects: NULL if they have no pointers, like a GCString.
+    size_t pointer_count;
+    const struct GCField *pointers;
+    // ArrayType fields, and the type of their elements (NULL if they have no pointers).
+    size_t array_count;
+    const struct GCField *arrays;
+    // Structs embedded by value.
+    size_t struct_count;
+    const struct GCField *structs;
+    // Set for a struct marked by a hand-written function instead, which the fields above are then ignored for.
+    void (*mark)(void *, struct MarkState *);
+};
+
+// Types of the GC values the runtime defines.
+extern const struct GCType gc_type_ArrayType, gc_type_GCString, gc_type_GCDouble, gc_type_GCInt, gc_type_GCPointer;
+
+// Type of objects without GC pointers, like the characters of a GCString, for gc_malloc_typed().
+extern const struct GCType gc_type_NoPointers;
+
+struct StackMap {
+    int index;
+
+    void (*fn_ptr)(void *, struct MarkState *);
+    // The type of the frame. If NULL, fn_ptr marks it instead.
+    const struct GCType *type;
+};
+
+// Generated by transformer.py: the type of every stack frame struct, indexed by the frame's id.
+extern struct StackMap STACK_MAP[];
+
+/**
+ * Allocates a zeroed object owned by the collector. Small objects come from pages of same-sized cells, with
+ * bump-pointer allocation through fresh pages and free lists rebuilt by the sweep. Every thread allocates from pages
+ * of its own, without locking, until they're full. Objects bigger than a page's largest cell get their own mapping,
+ * which is never moved. Mappings of dead large objects are reused.
+ *
+ * It may collect (see gc_set_growth()), or stop while another thread does, so GC values must be reachable from a stack
+ * frame across it, as transformer.py makes locals.
+ */
+void *gc_malloc(size_t size);
+
+// gc_malloc() of an object of the given type, which it records: with conservative roots (see gc_set_conservative()),
+// an object found from a stack is then traced precisely, rather than scanned like a stack.
+void *gc_malloc_typed(size_t size, const struct GCType *type);
+
+// Frees an object right away, in O(1). The object must not be reachable anymore. If another thread allocates from its
+// page, it's left to the next collection instead.
+void gc_free(void *ptr);
+
+#define GC_SCRATCH_INLINE 256
+
+/**
+ * Storage of an allocation site whose objects transformer.py's escape analysis found never outlive their function, nor
+ * point to GC objects: they're allocated here instead of the GC heap. Each allocation reuses the storage, since the
+ * previous object of the site is dead by then. Objects up to GC_SCRATCH_INLINE bytes stay in the struct, on the stack,
+ * and bigger ones are malloc()ed. gc_scratch_free() runs before the function returns.
+ */
+struct GCScratch {
+    void *buffer;
+    size_t capacity;
+    // Aligned like the objects of gc_malloc().
+    _Alignas(16) char inline_buffer[GC_SCRATCH_INLINE];
+};
+
+void gc_scratch_init(struct GCScratch *scratch);
+
+// A zeroed object of size bytes, like gc_malloc(), which the collector doesn't know about.
+void *gc_scratch_alloc(struct GCScratch *scratch, size_t size);
+
+void gc_scratch_free(struct GCScratch *scratch);
+
+/**
+ * Generational collection: objects that survived a collection are old, and gc_run() usually only collects the young
+ * ones (a minor collection), without tracing old objects. So a young object only reachable through an old one would be
+ * missed: every store into a GC object must be followed by gc_write_barrier(), which transformer.py emits.
+ *
+ * slot is the address of the GC-typed value that was written to, or of the struct or array that holds it, and fn the
+ * gc_mark_* function of its type. Slots outside the heap (stack frames) and slots of young objects are ignored.
+ */
+void gc_write_barrier(void *slot, void (*fn)(void *, struct MarkState *));
+
+// gc_write_barrier() for a slot whose type is described by a GCType rather than a marking function.
+void gc_write_barrier_typed(void *slot, const struct GCType *type);
+
+/**
+ * ArrayType as a growable vector. arr holds capacity elements, of which the first len are in use: marking only traces
+ * those, and the operations below keep the rest NULL. An array whose capacity is below its len, e.g. set up by hand
+ * with only arr and len, has exactly len elements. Copies of an ArrayType share their buffer until one of them grows.
+ *
+ * arr is the address of the ArrayType, which may be in a GC object: the functions that store elements follow the stores
+ * with a write barrier. Those that grow the buffer allocate, and so may collect like gc_malloc().
+ *
+ * The barrier of the plain functions only marks the elements, like gc_mark_ArrayType(). Elements with pointers of their
+ * own take the _typed variants, with the GCType of the elements, or a minor collection won't trace their fields. Use
+ * them for every store into such an array: an element marked untraced by a plain barrier isn't traced afterwards.
+ */
+
+// Grows the buffer to hold at least capacity elements, to twice its capacity if that's more.
+void gc_array_reserve(ArrayType *arr, size_t capacity);
+void gc_array_reserve_typed(ArrayType *arr, size_t capacity, const struct GCType *element);
+
+// Appends elem, in amortized O(1).
+void gc_array_push(ArrayType *arr, void *elem);
+void gc_array_push_typed(ArrayType *arr, void *elem, const struct GCType *element);
+
+// Replaces the removed elements from index on with the count ones of items, moving the tail once. items must not point
+// into the buffer of arr. With no items, it's a bulk remove.
+void gc_array_splice(ArrayType *arr, size_t index, size_t removed, void **items, size_t count);
+void gc_array_splice_typed(ArrayType *arr, size_t index, size_t removed, void **items, size_t count,
+                           const struct GCType *element);
+
+// Removes the elements keep() returns false for, in one pass that keeps the order of the others. keep() gets every
+// element in order, with its index before the removal, and must not collect. Returns the number of elements removed.
+size_t gc_array_retain_if(ArrayType *arr, bool (*keep)(void *elem, size_t index, void *arg), void *arg);
+
+// Marks obj as reachable. Returns true if it wasn't marked yet, so callers only trace into an object once: shared
+// objects are traced once per collection, and cycles terminate.
+bool gc_mark_plain(const void *obj, struct MarkState *state);
+
+// Marks obj, and if it wasn't marked yet and fn isn't NULL, makes it grey: fn traces it later, from the worklist
+// rather than from this call, so marking doesn't recurse. A compacting collection can't update the reference, so it
+// doesn't move obj (nor does gc_mark_plain()).
+void gc_mark_object(const void *obj, void (*fn)(void *, struct MarkState *), struct MarkState *state);
+
+// Marks the object the pointer at slot points to, like gc_mark_object(). If a compacting collection moves the object,
+// the pointer is updated. Hand-written marking functions should mark every pointer field with it.
+void gc_mark_pointer(void *slot, void (*fn)(void *, struct MarkState *), struct MarkState *state);
+
+// Marks the array and its elements. Elements newly marked are traced with fnptr, unless it's NULL.
+void gc_mark_ArrayType1(ArrayType *arr, void (*fnptr)(void *, struct MarkState *), struct MarkState *state);
+
+void gc_mark_ArrayType(ArrayType *arr, struct MarkState *state);
+
+// gc_mark_ArrayType1() for elements of the given type.
+void gc_mark_ArrayType_typed(ArrayType *arr, const struct GCType *element, struct MarkState *state);
+
+// Marks the fields of the struct at obj, as type describes it. The objects they point to are traced later, from the
+// worklist, and moved by a compacting collection like with gc_mark_pointer().
+void gc_mark_typed(void *obj, const struct GCType *type, struct MarkState *state);
+
+void gc_mark_GCString(GCString *str, struct MarkState *state);
+
+// Shadow stack of the stack frame structs generated by transformer.py. The first member of every frame is its id
+// in STACK_MAP. Frames are pushed to the current shadow stack of the calling thread.
+void gc_push_stack_frame(void *ptr);
+
+void gc_pop_stack_frame();
+
+/**
+ * The frames of one thread of control, e.g. a task of runtime.c (see gc_task.c). Collections mark the frames of every
+ * shadow stack. Every thread starts on one of its own, and gc_switch_stack() makes another one current. A zeroed struct
+ * is an empty stack, which grows as frames are pushed.
+ */
+struct GCShadowStack {
+    void **frames;
+    size_t count, capacity;
+    // Whether its owner stopped at a safepoint, where every GC value it still uses is in its frames, rather than
+    // anywhere (like a pre-empted task). Set when another stack is switched to.
+    bool parked;
+    // Whether gc_malloc() ran on it: with conservative roots, its owner may then hold GC values without frames.
+    bool allocated;
+    // Whether it's in the list of stacks collections mark, and the next one there.
+    bool registered;
+    struct GCShadowStack *next;
+};
+
+// Makes stack the current shadow stack of the calling thread, and collections mark it from then on. parked tells
+// whether the owner of the stack that was current stops at a safepoint. A stack belongs to the thread it was first
+// switched to on.
+void gc_switch_stack(struct GCShadowStack *stack, bool parked);
+
+// Drops every frame of stack, e.g. once the task it belonged to exited, and forgets that it allocated.
+void gc_stack_clear(struct GCShadowStack *stack);
+
+// Whether every shadow stack of the calling thread but the current one is parked or empty, so the collector knows all
+// of their roots. With conservative roots, empty ones that allocated must be parked too. Other threads are stopped by
+// the collection itself.
+bool gc_stacks_parked();
+
+/**
+ * If set, collections and incremental steps call it with collecting true before they start, and it must return once
+ * gc_stacks_parked(), e.g. by letting the other tasks run until they park. While a collection waits there, gc_malloc()
+ * calls it with collecting false, so the allocating task can park. Only called outside of the heap code.
+ */
+extern void (*gc_safepoint_hook)(bool collecting);
+
+// False while the calling thread is in the middle of changing the heap or collecting: a pre-emptive scheduler must not
+// switch to another task then, which would find the heap half-changed.
+bool gc_preemptible();
+
+/**
+ * Threads: the program's thread uses the heap from the start, and others call gc_attach_thread() before they do, and
+ * gc_detach_thread() once they're done, with no frames left. A collection, run by any thread, first stops the others
+ * at a safepoint: gc_malloc(), gc_run(), gc_step() and gc_safepoint(), which a thread that runs for long without
+ * allocating should call. A thread that blocks, e.g. in pthread_join(), without leaving the heap for good calls
+ * gc_park_thread() first: collections don't wait for it, and it mustn't touch GC objects until gc_unpark_thread(),
+ * which waits for a collection in progress to finish. Conservative roots only work with the program's thread, and so
+ * do task stacks: gc_safepoint_hook switches tasks of the scheduler, which runs on that thread, so gc_attach_thread()
+ * refuses once it's set. The settings (gc_set_*, gc_use_task_stacks()) are made before starting threads, apart from
+ * gc_set_profile().
+ */
+void gc_attach_thread();
+
+void gc_detach_thread();
+
+void gc_safepoint();
+
+void gc_park_thread();
+
+void gc_unpark_thread();
+
+// Marks everything reachable from the shadow stack, then frees the rest. Only young objects are collected, unless the
+// old ones have grown by the growth factor (see gc_set_growth()) since the last major collection.
+void gc_run();
+
+// Collects the whole heap.
+void gc_run_major();
+
+/**
+ * Compaction: with it enabled, major collections run by gc_run() or gc_run_major() evacuate the pages that were less
+ * than half full after the last collection. The objects they still hold are copied densely to other pages, the
+ * pointers to them are updated through the stack frames and the generated type descriptors, and the pages are freed.
+ * Large objects never move, and neither do objects only marked with gc_mark_object() or gc_mark_plain(). Collections
+ * gc_malloc() triggers and incremental cycles don't compact, so GC pointers may be kept in C variables across
+ * allocations, but only in stack frames across gc_run(). Neither do collections while other threads are attached.
+ * Compacting collections mark on one thread. Off by default.
+ */
+void gc_set_compaction(bool compaction);
+
+/**
+ * Conservative roots, an alternative to stack frames for code that doesn't push any (transformer.py --conservative):
+ * with them enabled, collections also scan the stacks word by word, and the callee-saved registers. A word that points
+ * into an allocated object keeps the object alive, as found through the page map; the object is then traced with the
+ * type gc_malloc_typed() gave it, or scanned word by word too if it has none. The words may just look like pointers, so
+ * objects found this way can't move: collections don't compact while it's enabled. Stack frames are still marked.
+ *
+ * The stack scanned is that of the thread that enabled it, from where the collection runs. With gc_use_task_stacks(),
+ * gc_scan_stacks_hook also scans the stacks of the tasks. Off by default.
+ */
+void gc_set_conservative(bool conservative);
+
+// If set, conservative collections call it to scan other stacks than the thread's: it calls scan with state on every
+// range of memory that may hold roots. sp is the collecting code's stack pointer, which the current stack is live from.
+extern void (*gc_scan_stacks_hook)(const void *sp,
+                                   void (*scan)(const void *start, const void *end, struct MarkState *state),
+                                   struct MarkState *state);
+
+/**
+ * Collections are triggered by allocation, GOGC-style: the heap may grow by percent of what was live after the last
+ * collection (and to at least a few MB) before gc_malloc() runs gc_run(). 100 by default, i.e. the heap is at most
+ * about twice the live data. A negative percent turns automatic collections off, so they only happen through gc_run().
+ */
+void gc_set_growth(int percent);
+
+/**
+ * Incremental collection: with it enabled, a major collection starts as a cycle once the heap has grown by the growth
+ * factor since the last one (and is at least a few MB), and the program runs between its steps. Each step marks up to
+ * a budget of objects, and the last one sweeps. While a cycle runs, every 64 kB allocated does a step of step_budget
+ * objects, unless step_budget is 0. gc_run() finishes a cycle in progress. Cycles replace the stop-the-world
+ * collections gc_malloc() triggers.
+ */
+void gc_set_incremental(bool incremental, size_t step_budget);
+
+/**
+ * Lazy sweeping: with it enabled, collections (and incremental cycles) leave pages of small objects unswept, and only
+ * free dead large objects. Allocation sweeps an unswept page once it gets to it looking for room, so the pause is
+ * mostly marking, and the sweep is spread over the allocations after it. Until its page is swept, a dead object still
+ * counts as allocated. Off by default.
+ */
+void gc_set_lazy_sweep(bool lazy);
+
+// Does a step of the cycle in progress, if there is one. Returns true if the cycle still isn't finished.
+bool gc_step(size_t budget);
+
+/**
+ * Lets the tasks of runtime.c use the GC heap, pre-empted or not: every task gets its own shadow stack, switched by the
+ * scheduler along with its context, and cleared when it exits. With conservative roots, the stacks of the tasks are
+ * scanned too. Tasks aren't pre-empted inside the collector, and a
+ * collection yields until no other task with frames is pre-empted, i.e. until they all yielded, parked, or allocated.
+ * Call it before runtime_run(). Defined in gc_task.c, like gc_marker_task().
+ */
+void gc_use_task_stacks();
+
+// Entry function of a task that drives incremental cycles from the scheduler of runtime.c: a step of (size_t) arg
+// objects every time it runs.
+void gc_marker_task(void *arg);
+
+// Whether every collection prints how many objects it freed. True by default.
+extern bool gc_verbose;
+
+// Number of threads collections mark and sweep with, the calling thread included: the others are worker threads the
+// collector starts, which only run during collections. 1 by default. Incremental steps always mark on one thread, and
+// the last step of a cycle on all of them.
+void gc_set_threads(int threads);
+
+struct GCStats {
+    // Bytes allocated since the program started, and bytes in use: whole cells and mappings of objects not freed yet.
+    size_t total_allocated_bytes;
+    size_t heap_bytes;
+    // Bytes in use right after the last collection, i.e. what it found live.
+    size_t live_bytes;
+    // Collections finished (incremental cycles included), and how many of them were major.
+    size_t collections;
+    size_t major_collections;
+    // Time spent in pauses: stop-the-world collections and steps of incremental cycles.
+    long total_pause_ns;
+    // Bytes of objects compacting collections moved.
+    size_t moved_bytes;
+    // Large objects that reused the mapping of a dead one rather than mapping their own.
+    size_t large_reused;
+    // Time the last collection spent marking and sweeping. For an incremental cycle, only its last step counts.
+    long last_mark_ns;
+    long last_sweep_ns;
+};
+
+void gc_get_stats(struct GCStats *stats);
+
+// If set, called with the length of every pause: a stop-the-world collection, or a step of a cycle.
+extern void (*gc_pause_hook)(long ns);
+
+// Where objects are allocated, for the heap profile. transformer.py generates one per allocation in gc.c.
+struct GCSite {
+    const char *function;
+    const char *file;
+    int line;
+    // What's allocated, e.g. "GCString", "ArrayType" (for its buffer) or "Nested1".
+    const char *type;
+};
+
+// The site of the next gc_malloc() of the thread, which resets it. transformer.py sets it right before statements that
+// allocate. Objects allocated without one are profiled as allocated by "(unknown)".
+extern __thread const struct GCSite *gc_site;
+
+/**
+ * Heap profile: gc_malloc() samples one object every sample_bytes allocated on average (at random intervals, so
+ * allocation patterns don't bias it), and keeps the sampled objects with their site until they're found dead. After
+ * every collection, the profile is written to path, if it isn't NULL: objects and bytes allocated at every site since
+ * the program started, and still in use, estimated from the samples, in pprof's format, with the type each site
+ * allocates as the "type" label (e.g. `pprof -sample_index=inuse_space -tagroot=type <binary> <path>`).
+ * Allocations that aren't sampled only count down the interval, so it's cheap enough to leave on. 0 turns it off, as
+ * it is by default.
+ */
+void gc_set_profile(size_t sample_bytes, const char *path);
+
+// Writes the profile as of the last collection. Returns false, with errno set, if it can't.
+bool gc_write_profile(const char *path);
+
+#endif //P1_GC_RUNTIME_H
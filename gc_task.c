@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "gc_runtime.h"
+#include "runtime.h"
+
+// Shadow stack of every task slot, and the task-local key that clears it once the task exits.
+static struct GCShadowStack task_stacks[NUM_TASKS];
+static int stack_key = -1;
+
+static void clear_task_stack(void *stack) {
+    gc_stack_clear(stack);
+}
+
+static void switch_stack(int from, int to) {
+    sch.blocks[to].locals[stack_key] = &task_stacks[to];
+    gc_switch_stack(&task_stacks[to], !sch.preempted[from]);
+}
+
+// A collection lets the other tasks run until none of them is pre-empted with frames. A task that allocates while it
+// waits just gives it the CPU.
+static void wait_for_safepoint(bool collecting) {
+    if (!collecting) {
+        task_yield();
+        return;
+    }
+    while (!gc_stacks_parked()) task_yield();
+}
+
+// Conservative roots of the tasks: the live part of every stack, from the saved stack pointer (from sp for the task
+// collecting) to the top, and the registers saved in the context. Those of a pre-empted task are in its signal frame.
+static void scan_task_stacks(const void *sp, void (*scan)(const void *, const void *, struct MarkState *),
+                             struct MarkState *state) {
+    for (int i = 0; i < sch.taskno; i++) {
+        if (!sch.alive[i]) continue;
+        const char *low = sch.protection[i].end, *top = low + task_stack_size();
+        if ((const char *) sp >= low && (const char *) sp < top) {
+            scan(sp, top, state);
+        } else {
+            scan(sch.tasks[i].rsp, top, state);
+            scan(&sch.tasks[i], &sch.tasks[i] + 1, state);
+        }
+    }
+}
+
+void gc_use_task_stacks() {
+    if (stack_key >= 0) return;
+    stack_key = task_local_new(clear_task_stack);
+    if (stack_key < 0) {
+        fprintf(stderr, "GC task stacks: no task-local key left\n");
+        exit(1);
+    }
+    sch.switch_hook = switch_stack;
+    sch.may_preempt = gc_preemptible;
+    gc_safepoint_hook = wait_for_safepoint;
+    gc_scan_stacks_hook = scan_task_stacks;
+}
+
+void gc_marker_task(void *arg) {
+    size_t budget = (size_t) arg;
+    for (;;) {
+        gc_step(budget);
+        task_yield();
+    }
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc_runtime.h"
+
+/**
+ * Regression checks of the collector, run by ctest. Each check exits with a message and status 1 on failure. The stack
+ * frames and type descriptors are written the way transformer.py generates them.
+ *
+ * Usage: gc_test
+ */
+
+#define CHECK_NAME "young name"
+#define CHECK_GARBAGE 10000
+
+struct Node {
+    GCString name;
+};
+
+struct Holder {
+    ArrayType nodes;
+};
+
+struct StackFrame_check {
+    int id;
+    struct Holder *holder;
+    struct Node *node;
+};
+
+static const struct GCField gc_pointers_Node[] = {{offsetof(struct Node, name), NULL}};
+
+const struct GCType gc_type_Node = {.size = sizeof(struct Node), .pointer_count = 1, .pointers = gc_pointers_Node};
+
+static const struct GCField gc_arrays_Holder[] = {{offsetof(struct Holder, nodes), &gc_type_Node}};
+
+const struct GCType gc_type_Holder = {.size = sizeof(struct Holder), .array_count = 1, .arrays = gc_arrays_Holder};
+
+static const struct GCField gc_pointers_StackFrame_check[] = {
+        {offsetof(struct StackFrame_check, holder), &gc_type_Holder},
+        {offsetof(struct StackFrame_check, node), &gc_type_Node}};
+
+const struct GCType gc_type_StackFrame_check = {.size = sizeof(struct StackFrame_check),
+                                                .pointer_count = 2,
+                                                .pointers = gc_pointers_StackFrame_check};
+
+struct StackMap STACK_MAP[] = {{0, NULL, &gc_type_StackFrame_check}};
+
+static void fail(const char *check, const char *message) {
+    fprintf(stderr, "%s: %s\n", check, message);
+    exit(1);
+}
+
+// Fills the cells freed by the last collection with strings of the same size, so a name freed too early is overwritten.
+static void overwrite_freed() {
+    for (int i = 0; i < CHECK_GARBAGE; i++) {
+        GCString garbage = gc_malloc(sizeof CHECK_NAME);
+        memset(garbage, 'x', sizeof CHECK_NAME - 1);
+    }
+}
+
+/**
+ * A young node pushed into the array of an old holder is only reachable through the holder, so the minor collection
+ * after the push must trace the node's fields from the array's write barrier, not only mark the node.
+ */
+static void check_array_barrier(const char *check, bool splice) {
+    struct StackFrame_check stack_frame;
+    memset(&stack_frame, 0, sizeof stack_frame);
+    gc_push_stack_frame((void *) &stack_frame);
+
+    struct Holder *holder = stack_frame.holder = gc_malloc(sizeof(struct Holder));
+    gc_array_reserve_typed(&holder->nodes, 1, &gc_type_Node);
+    gc_run_major();
+
+    struct Node *node = stack_frame.node = gc_malloc(sizeof(struct Node));
+    GCString name = gc_malloc(sizeof CHECK_NAME);
+    strcpy(name, CHECK_NAME);
+    node->name = name;
+    gc_write_barrier_typed(node, &gc_type_Node);
+    if (splice) {
+        gc_array_splice_typed(&holder->nodes, 0, 0, (void **) &node, 1, &gc_type_Node);
+    } else {
+        gc_array_push_typed(&holder->nodes, node, &gc_type_Node);
+    }
+    stack_frame.node = node = NULL;
+
+    gc_run();
+    overwrite_freed();
+    node = holder->nodes.arr[0];
+    if (holder->nodes.len != 1 || strcmp(node->name, CHECK_NAME) != 0) fail(check, "the young node's name was freed");
+    gc_pop_stack_frame();
+}
+
+int main() {
+    gc_set_growth(-1);
+    check_array_barrier("array_push_barrier", false);
+    check_array_barrier("array_splice_barrier", true);
+    printf("All checks passed\n");
+    return 0;
+}
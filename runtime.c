@@ -0,0 +1,697 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+
+#include <stdio.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/auxv.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <time.h>
+#include <math.h>
+
+#include "runtime.h"
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "EndlessLoop"
+
+long my_clock() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000 * 1000 + t.tv_nsec / 1000;
+}
+
+// Default, global scheduler instance
+struct Scheduler sch;
+
+// Every epoll registration carries both the task and the fd, so a wakeup can be matched to what the task waits for.
+static uint64_t epoll_data(int fd, int taskid) {
+    return (uint64_t) (uint32_t) fd << 32 | (uint32_t) taskid;
+}
+
+__thread struct TaskBlock *current_task;
+
+// Read by get_context1() in a.asm: whether the running task saves its FPU control state on cooperative switches.
+int context_full_abi;
+
+void set_context_flavour(enum ContextFlavour flavour) {
+    sch.flavour = flavour;
+}
+
+
+void add_to_watchlist(int fd, int taskid) {
+    struct epoll_event ev;
+    ev.data.u64 = epoll_data(fd, taskid);
+    ev.events = EPOLLIN;
+    assert(epoll_ctl(sch.epollfd, EPOLL_CTL_ADD, fd, &ev) == 0);
+}
+
+// The scheduler updates the run queue too, so tasks hold it off while they change it. The signal handler skips ticks
+// while sch.running is set, which is much cheaper than a critical section.
+static bool hold_scheduler() {
+    bool was_running = sch.running;
+    sch.running = true;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    return was_running;
+}
+
+static void release_scheduler(bool was_running) {
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    sch.running = was_running;
+}
+
+static void queue_place(int pos, int id) {
+    sch.runqueue[pos] = id;
+    sch.queue_index[id] = pos;
+}
+
+static void queue_sift_up(int pos) {
+    int id = sch.runqueue[pos];
+    while (pos > 1 && sch.moneys[sch.runqueue[pos / 2]] < sch.moneys[id]) {
+        queue_place(pos, sch.runqueue[pos / 2]);
+        pos /= 2;
+    }
+    queue_place(pos, id);
+}
+
+static void queue_sift_down(int pos) {
+    int id = sch.runqueue[pos];
+    for (;;) {
+        int child = pos * 2;
+        if (child > sch.queued) break;
+        if (child < sch.queued && sch.moneys[sch.runqueue[child + 1]] > sch.moneys[sch.runqueue[child]]) child++;
+        if (sch.moneys[sch.runqueue[child]] <= sch.moneys[id]) break;
+        queue_place(pos, sch.runqueue[child]);
+        pos = child;
+    }
+    queue_place(pos, id);
+}
+
+static void queue_remove(int id) {
+    int pos = sch.queue_index[id];
+    sch.queue_index[id] = 0;
+    if (sch.preempt_rate[id] < 0.5f) sch.queued_interactive--;
+    int last = sch.runqueue[sch.queued--];
+    if (last == id) return;
+    queue_place(pos, last);
+    queue_sift_up(pos);
+    queue_sift_down(sch.queue_index[last]);
+}
+
+// Puts a task into the run queue or takes it out, after a change to whether it can run.
+// A pre-empted task stays runnable even if it cleared its ready mask: it was about to check what it waits for, and
+// parks by yielding once it did. Otherwise a wake-up landing between the two would be lost.
+static void update_queue(int id) {
+    bool runnable = id != 0 && sch.alive[id] && (sch.ready_mask[id] || sch.preempted[id]) && sch.sleep_arr[id] == 0;
+    if (runnable && sch.queue_index[id] == 0) {
+        if (sch.preempt_rate[id] < 0.5f) sch.queued_interactive++;
+        queue_place(++sch.queued, id);
+        queue_sift_up(sch.queued);
+    } else if (!runnable && sch.queue_index[id] != 0) {
+        queue_remove(id);
+    }
+}
+
+// Every change of the ready mask goes through here, so the run queue follows it.
+static void set_ready(int id, bool ready) {
+    bool was_running = hold_scheduler();
+    sch.ready_mask[id] = ready;
+    update_queue(id);
+    release_scheduler(was_running);
+}
+
+// Called with the scheduler held off.
+static void add_timed(int id) {
+    if (sch.is_timed[id]) return;
+    sch.is_timed[id] = true;
+    sch.timed[sch.timed_count++] = id;
+}
+
+// What to print when we're overflowing the stack.
+// Why not just include it in the function? When we are close to a stack overflow, we can't do anything
+// as doing anything will actually trigger a stack overflow.
+// Therefore, we preserve non-stack space to hold the message, then print this message from inside the near-overflowing
+// function.
+const char *overflow_message = "Overflow stack detected\n";
+
+// Checks if the stack pointer is within 0x800 bytes of the end of the stack.
+void stack_checker() {
+    // Flag value to get the address of the stack pointer
+    int stack_flag = 0;
+    void *stack_ptr = &stack_flag;
+    // Stack grows downwards, so we decrement.
+    stack_ptr -= 0x800;
+    struct ProtectRange protected = sch.protection[sch.curtask];
+
+    // If stack pointer is within the protected section (4096 bytes), then we're screwed.
+    // No way to recover, print message and exit
+    if (stack_ptr <= protected.end && stack_ptr >= protected.start) {
+        // Use write instead of puts/printf because it doesn't use up that much stack space...
+        // Can't use stack when we have no stack.
+        int _result = write(1, overflow_message, 24);
+
+        // Force a segmentation fault here.
+        volatile int a = *(int *) stack_ptr;
+        exit(0);
+    } else {
+    }
+}
+
+
+void task_yield() {
+    get_context1();
+    sch.running = false;
+}
+
+
+void sleep_for(float ms, const char *name) {
+    long start = my_clock();
+    bool was_running = hold_scheduler();
+    sch.sleep_arr[sch.curtask] += ms * 1000;
+    add_timed(sch.curtask);
+    update_queue(sch.curtask);
+    release_scheduler(was_running);
+    // Context switch here.
+    get_context1();
+    sch.running = false;
+
+    // The task resumes here:
+    long end = my_clock();
+    float inaccuracy = fabsf(ms - (float) (end - start) / 1000);
+
+    // Check if we slept for an inaccurate amount of time.
+    if (inaccuracy > 0.1f) {
+        printf("Inaccurate %f %s\n", inaccuracy, name);
+    }
+    assert(inaccuracy / (float) ms < 0.3);
+}
+
+
+void run_program(int index) {
+    assert(index < sch.taskno);
+    if (sch.switch_hook != NULL) sch.switch_hook(sch.curtask, index);
+    sch.curtask = index;
+    current_task = &sch.blocks[index];
+    context_full_abi = sch.flavours[index] == CONTEXT_FULL_ABI;
+    set_context(&sch.tasks[sch.curtask]);
+}
+
+// Handle the signal from the kernel. Check the validity of the stack, then call to be context-switched out.
+void sig_handler(int num) {
+    if (sch.running || is_in_critical() || !sch.ready || (sch.may_preempt != NULL && !sch.may_preempt())) {
+        return;
+    }
+    sch.running = true;
+    sch.preempting = true;
+    stack_checker();
+    get_context_signal();
+    sch.running = false;
+
+    // Possible stack overflow point -- signal handler fires here while we're stuck in this stack frame.
+    // Solution: use a smaller alarm tick rate
+}
+
+// Re-arms the interval timer, unless it already runs with that interval. 0 disarms it.
+static void arm_timer(long quantum_us) {
+    if (quantum_us == sch.quantum_us) return;
+    struct itimerval itimer;
+    itimer.it_interval.tv_sec = quantum_us / 1000000;
+    itimer.it_interval.tv_usec = quantum_us % 1000000;
+    itimer.it_value = itimer.it_interval;
+    if (setitimer(ITIMER_REAL, &itimer, NULL)) {
+        perror("Set timer error");
+    }
+    sch.quantum_us = quantum_us;
+}
+
+// Setups the interval timer for Linux kernel to interrupt our process and call the signal handler with a SIGALRM.
+// This means CPU-intensive processes will still get interrupted and context-switched.
+void setup_timer() {
+    arm_timer(SCHED_LATENCY_MS * 1000);
+    struct sigaction act = {0};
+    act.sa_flags = SA_NODEFER;
+    act.sa_handler = sig_handler;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGALRM, &act, NULL);
+    sigaction(SIGSEGV, &act, NULL);
+}
+
+// Uses epoll to check if any of the registered file descriptors are ready.
+// If yes, then sets the ready_mask on the task.
+// Waits up to timeout_ms for an event; the scheduler passes 0 so it never blocks.
+void watch_for_io(int timeout_ms) {
+    // Static so the scheduler, which runs on the small task stacks, doesn't need room for it.
+    static struct epoll_event events[256];
+    int numfds = epoll_wait(sch.epollfd, events, 256, timeout_ms);
+    if (numfds >= 0) {
+        for (int i = 0; i < numfds; i++) {
+            uint32_t ready_id = (uint32_t) events[i].data.u64;
+            int fd = (int) (events[i].data.u64 >> 32);
+            if (sch.waiting_fd[ready_id] == fd) {
+                sch.waiting_fd[ready_id] = -1;
+                sch.wait_result[ready_id] = 0;
+            }
+            set_ready(ready_id, true);
+        }
+    } else if (errno != EINTR) {
+        perror("Watch for IO failed");
+    }
+}
+
+void runtime_init() {
+    sch.epollfd = epoll_create(1);
+    if (sch.epollfd < 0) {
+        perror("Runtime epoll");
+        exit(1);
+    }
+    setup_timer();
+    new_task(&idle_task);
+}
+
+// Jumps to the idle task, which yields to the scheduler: from then on, the scheduler runs the other tasks.
+void runtime_run() {
+    sch.ready = true;
+    run_program(0);
+}
+
+// Only runs when no other task is ready, and the timer is disarmed then. Instead of spinning, block in epoll so a task
+// woken by IO gets the CPU as soon as its event arrives, or until the next sleeping task is due.
+void idle_task() {
+    for (;;) {
+        watch_for_io(sch.next_wake_us > 0 ? (int) ((sch.next_wake_us + 999) / 1000) : -1);
+        task_yield();
+    }
+}
+
+void clear_ready_mask() {
+    set_ready(sch.curtask, false);
+    task_yield();
+}
+
+// Makes a task ready from another task. The timer may be disarmed because the waker was the only runnable task, and
+// now there are two of them.
+static void wake_from_task(int taskid) {
+    set_ready(taskid, true);
+    if (sch.ready && sch.quantum_us == 0) arm_timer(MIN_GRANULARITY_MS * 1000);
+}
+
+void task_wake(int taskid) {
+    wake_from_task(taskid);
+}
+
+void task_wait_counter(int *counter, int target) {
+    for (;;) {
+        set_ready(sch.curtask, false);
+        if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) >= target) break;
+        task_yield();
+    }
+    set_ready(sch.curtask, true);
+}
+
+// Ends the wait of a task parked in task_wait_fd() without its fd becoming ready.
+static void abort_wait(int taskid, int result) {
+    epoll_ctl(sch.epollfd, EPOLL_CTL_DEL, sch.waiting_fd[taskid], NULL);
+    sch.waiting_fd[taskid] = -1;
+    sch.wait_result[taskid] = result;
+    set_ready(taskid, true);
+}
+
+uint64_t task_handle(int taskid) {
+    return (uint64_t) sch.generations[taskid] << 32 | (uint32_t) taskid;
+}
+
+bool task_cancel(uint64_t handle) {
+    int id = (int) (uint32_t) handle;
+    if (id >= sch.taskno || !sch.alive[id] || sch.generations[id] != (uint32_t) (handle >> 32)) {
+        return false;
+    }
+    bool was_critical = is_in_critical();
+    if (!was_critical) enter_critical();
+    sch.cancelled[id] = true;
+    if (sch.waiting_fd[id] >= 0) {
+        abort_wait(id, -ECANCELED);
+    }
+    wake_from_task(id);
+    if (!was_critical) exit_critical();
+    return true;
+}
+
+bool task_is_cancelled() {
+    return sch.cancelled[sch.curtask];
+}
+
+long start_time = 0;
+
+/**
+ * Timer interval once the scheduler switches to the next task, given the number of runnable tasks (including the next
+ * one), how many of the others are interactive, whether any task is parked, and when the next sleeper is due.
+ *
+ * With other tasks waiting for the CPU, share SCHED_LATENCY_MS between them when some are interactive, so they run
+ * soon after waking. If all of them are CPU-bound, latency doesn't matter and a full SCHED_LATENCY_MS slice means fewer
+ * signals (and fewer chances for nested handlers to grow the stack).
+ * A single runnable task only needs the tick to notice IO of parked tasks and sleepers that are due. The idle task
+ * waits for both in epoll, so the timer is off while it runs.
+ */
+static long pick_quantum(int runnable, int interactive, bool parked, long next_wake_us) {
+    long quantum_us = 0;
+    if (runnable > 1) {
+        quantum_us = interactive > 0 ? SCHED_LATENCY_MS * 1000 / runnable : SCHED_LATENCY_MS * 1000;
+        if (quantum_us < MIN_GRANULARITY_MS * 1000) quantum_us = MIN_GRANULARITY_MS * 1000;
+    } else if (runnable == 1 && parked) {
+        quantum_us = SCHED_LATENCY_MS * 1000;
+    }
+    if (runnable > 0 && next_wake_us > 0 && (quantum_us == 0 || next_wake_us < quantum_us)) {
+        quantum_us = next_wake_us;
+    }
+    return quantum_us;
+}
+
+/**
+ * Scheduler implementation. Receives the recently switched-out context as an argument.
+ * Calculates the time elapsed that the task has run for, decrements that tasks' money,
+ * and increments all other non-running task's money.
+ *
+ * Decrements the sleep timers of sleeping tasks.
+ *
+ * Checks for new IO event via epoll()
+ *
+ * Then, runs the non-sleeping, non-IO-waiting task with the maximum money, from the top of the run queue. If there is
+ * none, runs the idle task.
+ */
+void scheduler(struct Context *c) {
+    sch.running = true;
+
+    if (start_time == 0) start_time = my_clock();
+    const long now = my_clock();
+    const long difference = now - start_time;
+    start_time = now;
+
+    watch_for_io(0);
+
+    sch.tasks[sch.curtask] = *c;
+
+    // Out of the queue while its money and preempt rate change, which decide its place and the interactive count.
+    if (sch.queue_index[sch.curtask] != 0) queue_remove(sch.curtask);
+    sch.moneys[sch.curtask] -= difference;
+    sch.preempt_rate[sch.curtask] = sch.preempt_rate[sch.curtask] * 0.75f + (sch.preempting ? 0.25f : 0.f);
+    sch.preempted[sch.curtask] = sch.preempting;
+    sch.preempting = false;
+    update_queue(sch.curtask);
+    sch.money_credit += (double) difference / sch.taskno;
+
+    long next_wake_us = 0;
+    int sleeping = 0;
+    for (int t = 0; t < sch.timed_count; t++) {
+        int i = sch.timed[t];
+        if (sch.deadlines[i] != 0 && sch.waiting_fd[i] >= 0) {
+            if (now >= sch.deadlines[i]) {
+                abort_wait(i, -ETIMEDOUT);
+            } else if (next_wake_us == 0 || sch.deadlines[i] - now < next_wake_us) {
+                next_wake_us = sch.deadlines[i] - now;
+            }
+        }
+        if (sch.sleep_arr[i] > 0) {
+            sch.sleep_arr[i] -= difference;
+            if (sch.sleep_arr[i] <= MIN_GRANULARITY_MS / 2.0 * 1000) {
+                sch.sleep_arr[i] = 0;
+                update_queue(i);
+            } else {
+                if (next_wake_us == 0 || sch.sleep_arr[i] < next_wake_us) next_wake_us = sch.sleep_arr[i];
+                if (sch.alive[i] && sch.ready_mask[i]) sleeping++;
+            }
+        }
+        if (sch.sleep_arr[i] == 0 && (sch.deadlines[i] == 0 || sch.waiting_fd[i] < 0)) {
+            sch.is_timed[i] = false;
+            sch.timed[t--] = sch.timed[--sch.timed_count];
+        }
+    }
+    sch.next_wake_us = next_wake_us;
+
+    int index = sch.queued > 0 ? sch.runqueue[1] : 0;
+    int runnable = sch.queued, interactive = sch.queued_interactive;
+    // Alive tasks besides the idle one that are neither queued nor sleeping wait for something.
+    bool parked = sch.taskno - 1 - sch.free_count > sch.queued + sleeping;
+    if (index != 0 && sch.preempt_rate[index] < 0.5f) interactive--;
+    arm_timer(pick_quantum(runnable, interactive, parked, next_wake_us));
+    run_program(index);
+}
+
+int task_local_new(void (*destructor)(void *)) {
+    if (sch.local_count == TASK_LOCAL_SLOTS) return -1;
+    sch.local_destructors[sch.local_count] = destructor;
+    return sch.local_count++;
+}
+
+// Runs while the task is still alive, so destructors may block or yield like any other task code.
+static void run_local_destructors() {
+    for (int key = 0; key < sch.local_count; key++) {
+        void *value = current_task->locals[key];
+        if (value != NULL && sch.local_destructors[key] != NULL) {
+            current_task->locals[key] = NULL;
+            sch.local_destructors[key](value);
+        }
+    }
+}
+
+void task_exit() {
+    run_local_destructors();
+    set_ready(sch.curtask, false);
+    bool was_running = hold_scheduler();
+    sch.alive[sch.curtask] = false;
+    sch.free_slots[sch.free_count++] = sch.curtask;
+    release_scheduler(was_running);
+    get_context1();
+
+    // Dead tasks are never scheduled again.
+    assert(false);
+}
+
+// First code every task runs: set_context() "returns" here on the task's fresh stack.
+static void task_entry() {
+    // The scheduler that switched to us is still marked as running.
+    sch.running = false;
+    int id = sch.curtask;
+    sch.entries[id](sch.args[id]);
+    task_exit();
+}
+
+// Usable stack of each task. Every pre-emption pushes a signal frame onto the task's stack, and with large XSAVE
+// areas (AVX-512, AMX) that frame alone is bigger than the 8 kB we used to give each task, so size stacks from the
+// kernel's minimum signal stack size.
+size_t task_stack_size() {
+    static size_t size = 0;
+    if (size == 0) {
+        size_t signal_frame = getauxval(AT_MINSIGSTKSZ);
+        if (signal_frame < (size_t) MINSIGSTKSZ) signal_frame = MINSIGSTKSZ;
+        size = (4096 * 2 + 2 * signal_frame + 4095) & ~4095UL;
+    }
+    return size;
+}
+
+/**
+ * Creates a new task from a function pointer.
+ * The stack is allocated using mmap and sized by task_stack_size().
+ * At the end of the stack, we keep a PROT_NONE page, so all reads/writes will segfault.
+ *
+ * I've been bitten by segmentation faults that have turned to be hidden, malignant stack overflows
+ * that it's very worth to section the end of the stack as unusable.
+ *
+ * This also allows us to do stack protection and give an early warning if the stack nearly overflows.
+ *
+ * Slots (and stacks) of exited tasks are reused before new ones are mapped.
+ */
+int new_task_arg(void (*func)(void *), void *arg) {
+    const size_t STACK_SIZE = task_stack_size();
+    bool was_critical = is_in_critical();
+    if (!was_critical) enter_critical();
+
+    int id;
+    if (sch.free_count > 0) {
+        id = sch.free_slots[--sch.free_count];
+    } else if (sch.taskno < NUM_TASKS) {
+        id = sch.taskno;
+        void *protect_low = mmap(NULL, 4096 + STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                                 0);
+        if (protect_low == MAP_FAILED || mprotect(protect_low, 4096, PROT_NONE) != 0) {
+            perror("Task stack");
+            exit(89);
+        }
+        struct ProtectRange range = {protect_low, protect_low + 4096};
+        sch.protection[id] = range;
+    } else {
+        exit(89);
+    }
+
+    struct Context c = {0};
+    char *rsp = (char *) (sch.protection[id].end + STACK_SIZE);
+    sch.flavours[id] = sch.flavour;
+    if (sch.flavour == CONTEXT_FULL_ABI) {
+        // Start with the default rounding mode and all exceptions masked, like a new thread.
+        c.mxcsr = 0x1f80;
+        c.fpucw = 0x37f;
+        c.flags = CONTEXT_HAS_CONTROL;
+    }
+    rsp = (char *) ((uintptr_t) rsp & -16L);
+    rsp -= 256;
+    // Leave room for a return address so task_entry starts with the stack alignment of a called function.
+    rsp -= 8;
+
+    c.rsp = rsp;
+    c.rip = (void *) task_entry;
+    sch.tasks[id] = c;
+    sch.entries[id] = func;
+    sch.args[id] = arg;
+    memset(&sch.blocks[id], 0, sizeof sch.blocks[id]);
+    sch.generations[id]++;
+    sch.cancelled[id] = false;
+    sch.waiting_fd[id] = -1;
+    sch.deadlines[id] = 0;
+    sch.sleep_arr[id] = 0;
+    sch.moneys[id] = -sch.money_credit;
+    sch.preempt_rate[id] = 0;
+    sch.preempted[id] = false;
+    sch.alive[id] = true;
+    if (id == sch.taskno) sch.taskno++;
+    set_ready(id, true);
+    if (sch.ready && sch.quantum_us == 0) arm_timer(MIN_GRANULARITY_MS * 1000);
+
+    if (!was_critical) exit_critical();
+    return id;
+}
+
+int new_task(void (*func)()) {
+    return new_task_arg((void (*)(void *)) func, NULL);
+}
+
+int task_wait_fd(int fd, uint32_t events, long timeout_ms) {
+    int id = sch.curtask;
+    if (sch.cancelled[id]) return -ECANCELED;
+
+    struct epoll_event ev;
+    ev.data.u64 = epoll_data(fd, id);
+    // One-shot, so the fd stops waking this task as soon as it has been reported once.
+    ev.events = events | EPOLLONESHOT;
+
+    // The scheduler can't run inside the critical section, so the wait is fully set up before any event, timeout or
+    // cancellation can end it.
+    enter_critical();
+    if (epoll_ctl(sch.epollfd, EPOLL_CTL_MOD, fd, &ev) != 0 &&
+        (errno != ENOENT || epoll_ctl(sch.epollfd, EPOLL_CTL_ADD, fd, &ev) != 0)) {
+        int err = errno;
+        perror("Wait for IO failed");
+        exit_critical();
+        return -err;
+    }
+    sch.waiting_fd[id] = fd;
+    sch.deadlines[id] = timeout_ms >= 0 ? my_clock() + timeout_ms * 1000 : 0;
+    if (timeout_ms >= 0) add_timed(id);
+    exit_critical();
+
+    // Other wakeups (task_wake(), events of fds registered with add_to_watchlist()) don't end the wait.
+    for (;;) {
+        set_ready(id, false);
+        if (sch.waiting_fd[id] < 0) break;
+        task_yield();
+    }
+    set_ready(id, true);
+    sch.deadlines[id] = 0;
+    return sch.wait_result[id];
+}
+
+int task_wait_readable(int fd, long timeout_ms) {
+    return task_wait_fd(fd, EPOLLIN, timeout_ms);
+}
+
+int task_wait_writable(int fd, long timeout_ms) {
+    return task_wait_fd(fd, EPOLLOUT, timeout_ms);
+}
+
+// Waits for fd without a timeout. Returns false with errno set if the wait failed.
+static bool await_fd(int fd, uint32_t events) {
+    int result = task_wait_fd(fd, events, -1);
+    if (result != 0) {
+        errno = -result;
+        return false;
+    }
+    return true;
+}
+
+ssize_t task_read(int fd, void *buf, size_t len) {
+    for (;;) {
+        enter_critical();
+        ssize_t n = read(fd, buf, len);
+        int err = errno;
+        exit_critical();
+        if (n >= 0 || (err != EAGAIN && err != EWOULDBLOCK)) {
+            errno = err;
+            return n;
+        }
+        if (!await_fd(fd, EPOLLIN)) return -1;
+    }
+}
+
+ssize_t task_write(int fd, const void *buf, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        enter_critical();
+        ssize_t n = write(fd, (const char *) buf + written, len - written);
+        int err = errno;
+        exit_critical();
+        if (n >= 0) {
+            written += n;
+        } else if (err == EAGAIN || err == EWOULDBLOCK) {
+            if (!await_fd(fd, EPOLLOUT)) return -1;
+        } else {
+            errno = err;
+            return -1;
+        }
+    }
+    return (ssize_t) written;
+}
+
+int task_accept(int listen_fd) {
+    for (;;) {
+        enter_critical();
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        int err = errno;
+        exit_critical();
+        if (fd >= 0 || (err != EAGAIN && err != EWOULDBLOCK)) {
+            errno = err;
+            return fd;
+        }
+        if (!await_fd(listen_fd, EPOLLIN)) return -1;
+    }
+}
+
+int task_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    enter_critical();
+    int result = connect(fd, addr, addrlen);
+    int err = errno;
+    exit_critical();
+    if (result == 0 || err != EINPROGRESS) {
+        errno = err;
+        return result;
+    }
+
+    if (!await_fd(fd, EPOLLOUT)) return -1;
+    socklen_t len = sizeof err;
+    enter_critical();
+    result = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    exit_critical();
+    if (result == 0 && err != 0) {
+        errno = err;
+        return -1;
+    }
+    return result;
+}
+
+#pragma clang diagnostic pop
@@ -0,0 +1,334 @@
+#ifndef P1_RUNTIME_H
+#define P1_RUNTIME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Flags of struct Context: which of the optional parts of the context were saved.
+#define CONTEXT_HAS_CONTROL 1
+
+// Layout is shared with a.asm.
+struct Context {
+    void *rip, *rsp, *rbx, *rbp, *r12, *r13, *r14, *r15;
+    // Full-ABI flavour only: MXCSR and x87 control word.
+    uint32_t mxcsr;
+    uint16_t fpucw;
+    uint16_t flags;
+};
+
+/**
+ * What a cooperative switch saves besides the callee-saved registers.
+ * CONTEXT_MINIMAL: nothing. Tasks share the rounding mode and exception masks. This is the default.
+ * CONTEXT_FULL_ABI: also the MXCSR and x87 control word, which the ABI has survive a call.
+ * Vector registers are caller-saved, so no cooperative switch saves them. Pre-emption always preserves the full state,
+ * because the kernel saves it in the signal frame. It only writes the vector registers a task has in use there, and
+ * runs the handler with them reset, so tasks that never touch SIMD don't pay for other tasks' AVX state.
+ */
+enum ContextFlavour {
+    CONTEXT_MINIMAL, CONTEXT_FULL_ABI
+};
+
+// Sets the flavour of tasks created from now on.
+void set_context_flavour(enum ContextFlavour flavour);
+
+// Maximum number of task slots. Slots of exited tasks are reused, so this bounds the number of tasks alive at once.
+// Targets that need many tasks (e.g. one per connection) override it at compile time: a switch costs O(log tasks)
+// for the run queue plus O(sleeping tasks), so tens of thousands of tasks are fine.
+#ifndef NUM_TASKS
+#define NUM_TASKS 30
+#endif
+
+/**
+ * Pre-emption is driven by SIGALRM, with a quantum that adapts to the load like CFS: every runnable task should get
+ * the CPU within SCHED_LATENCY_MS, but no task is pre-empted after less than MIN_GRANULARITY_MS. When no other task
+ * can take over the CPU, the timer is disarmed.
+ */
+#define SCHED_LATENCY_MS 20
+#define MIN_GRANULARITY_MS 2
+
+long my_clock();
+
+struct ProtectRange {
+    void *start, *end;
+};
+
+// Number of task-local keys that can exist. Every task has one slot per key.
+#define TASK_LOCAL_SLOTS 16
+
+// Task control block: per-task state that belongs to user code rather than to the scheduler.
+struct TaskBlock {
+    void *locals[TASK_LOCAL_SLOTS];
+};
+
+// Block of the task that is running. run_program() points it at the task it switches to.
+extern __thread struct TaskBlock *current_task;
+
+
+/**
+ * Critical sections: disable all alarm interrupts.
+ * Use when we're making a syscall, reading, or writing to a file descriptor.
+ * enter_critical() itself makes a syscall, so avoid calling in a loop because it will be slow.
+ */
+void enter_critical();
+
+bool is_in_critical();
+
+void exit_critical();
+
+/**
+ * All the information a scheduler needs in one struct
+ */
+struct Scheduler {
+    // True if the task is ready to run, false if not.
+    // Used for tasks that are awaiting for IO. We use epoll() to figure out
+    // which tasks can be unblocked, then set that task's ready mask on.
+    bool ready_mask[NUM_TASKS];
+
+    // File descriptor to the epoll instance we're using to track all other FD's
+    int epollfd;
+
+    // The number of sleep microseconds that each task has left. If this number is not zero for the task,
+    // then that task cannot run and must wait. At each scheduler tick, we decrement the time since the last tick
+    // of all sleeping tasks.
+    long sleep_arr[NUM_TASKS];
+
+    // How much "money" a task has. Derived from the Completely-Fair-Scheduler from Linux.
+    // At each scheduler tick, all tasks receive (time_elapsed) / (# of tasks) money.
+    // When a task runs, it uses up (time_elapsed) money.
+    // What all tasks receive is added up in money_credit instead, so a task has moneys[i] + money_credit.
+    double moneys[NUM_TASKS];
+    double money_credit;
+
+    // Tasks that can run (alive, ready and not sleeping, except the idle task), as a max-heap on their money in
+    // runqueue[1..queued], so picking the next task doesn't scan every slot. queue_index is a task's position in the
+    // heap, 0 if it isn't queued.
+    int runqueue[NUM_TASKS + 1];
+    int queue_index[NUM_TASKS];
+    int queued;
+
+    // How many queued tasks are interactive (preempt_rate below 0.5).
+    int queued_interactive;
+
+    // Tasks that may be sleeping or have a deadline, so the scheduler only checks the timers of those.
+    // Entries stay until the scheduler sees the timer is gone.
+    int timed[NUM_TASKS];
+    bool is_timed[NUM_TASKS];
+    int timed_count;
+
+    // How often each task was pre-empted rather than giving up the CPU itself, as a moving average: close to 1 for
+    // CPU-bound tasks, close to 0 for interactive ones.
+    float preempt_rate[NUM_TASKS];
+
+    // Stores the continuation point, stack pointer, and return pointer for all tasks.
+    struct Context tasks[NUM_TASKS];
+
+    // What a cooperative switch of each task saves, from sch.flavour when it was created.
+    enum ContextFlavour flavours[NUM_TASKS];
+
+    // The stack protection range for all tasks. If a tasks's stack pointer is close to this range,
+    // exit immediately to avoid subtle bugs.
+    struct ProtectRange protection[NUM_TASKS];
+
+    // False once the task has returned from its entry function. Dead slots are never scheduled.
+    bool alive[NUM_TASKS];
+
+    // Entry function and argument of each task. Called by task_entry() the first time the task runs.
+    void (*entries[NUM_TASKS])(void *);
+    void *args[NUM_TASKS];
+
+    // Generation of each slot, bumped every time new_task() reuses it, so stale task handles can be told apart.
+    uint32_t generations[NUM_TASKS];
+
+    // Set by task_cancel(). Waits of a cancelled task fail with ECANCELED instead of blocking.
+    bool cancelled[NUM_TASKS];
+
+    // The fd a task is parked on in task_wait_fd(), or -1 if it isn't waiting.
+    int waiting_fd[NUM_TASKS];
+
+    // Absolute time (my_clock()) at which the wait of a task times out, or 0 for no deadline.
+    long deadlines[NUM_TASKS];
+
+    // Outcome of the last wait: 0 if the fd became ready, otherwise -ETIMEDOUT or -ECANCELED.
+    int wait_result[NUM_TASKS];
+
+    // Control block of every task.
+    struct TaskBlock blocks[NUM_TASKS];
+
+    // Destructor of each task-local key (NULL if none), and the number of keys created.
+    void (*local_destructors[TASK_LOCAL_SLOTS])(void *);
+    int local_count;
+
+    // Slots of exited tasks. new_task() reuses them, together with their already-mapped stacks.
+    int free_slots[NUM_TASKS];
+    int free_count;
+
+    // Total number of tasks
+    int taskno;
+
+    // The task that was last ran.
+    int curtask;
+
+    // Set by the signal handler, so the scheduler can tell a pre-emption from a task yielding.
+    bool preempting;
+
+    // Interval the timer is armed with in microseconds, 0 while it's disarmed.
+    long quantum_us;
+
+    // Microseconds from the last scheduler run until the next sleeping task or deadline is due, 0 if there is none.
+    long next_wake_us;
+
+    // Flavour given to new tasks.
+    enum ContextFlavour flavour;
+
+    // If set, called by run_program() with the task that ran last and the one it switches to, for per-task state
+    // outside the context (like gc_task.c's shadow stacks).
+    void (*switch_hook)(int from, int to);
+
+    // Whether each task last gave up the CPU by being pre-empted, rather than by yielding or parking. For switch_hook,
+    // since a pre-empted task may hold GC pointers only in registers.
+    bool preempted[NUM_TASKS];
+
+    // If set, the signal handler only pre-empts a task while it returns true. Ticks it turns down are skipped.
+    bool (*may_preempt)();
+
+    // Whether the scheduler tick is running. Used to prevent nested interrupts (interrupting the scheduler).
+    volatile bool running;
+
+    // Whether the scheduler has initialized yet.
+    bool ready;
+};
+
+// Default, global scheduler instance
+extern struct Scheduler sch;
+
+/**
+ * Thanks to https://graphitemaster.github.io/fibers/#setting-the-context for tutorial and reference.
+ * Defined in a.asm.
+ *
+ * get_context: Save the stack pointer, base pointer, return address, and all non-volatile registers.
+ *  Then, calls the scheduler() function.
+ * set_context: Load all registers that were saved from get_context. Force write into the return address
+ *      portion of the stack, so we return to a different function then that called this.
+ *
+ * These two functions are extremely similar to getcontext/setcontext in <ucontext.h>
+ *
+ * These two functions are the core that lets us execute software in a non-stack based manner. Multiple
+ * tasks can run, be pre-empted, be saved, and then restarted using this scheme. It's a user-space implementation
+ * of the kernel's own context switching methods.
+ */
+extern void get_context1();
+
+// get_context1() for the signal handler. Skips the FPU control state, which the signal frame already holds.
+extern void get_context_signal();
+
+extern void set_context(struct Context *c);
+
+void scheduler(struct Context *c);
+
+// Switches to the task with the given id. Never returns.
+void run_program(int index);
+
+void setup_timer();
+
+// Do nothing task. We must have one of these (as task 0) so the program doesn't exit.
+void idle_task();
+
+/**
+ * Starting the runtime: runtime_init() creates the epoll instance, arms the timer and creates the idle task as task 0.
+ * The program then creates its own tasks, and runtime_run() starts scheduling them. It never returns.
+ */
+void runtime_init();
+
+void runtime_run();
+
+// Bytes of stack every task has, from the end of its protection range up.
+size_t task_stack_size();
+
+// Creates a new task and returns its id. new_task_arg() passes `arg` to the entry function.
+int new_task(void (*func)());
+
+int new_task_arg(void (*func)(void *), void *arg);
+
+// Gives up the CPU to the scheduler. The task keeps running later if it is still ready.
+void task_yield();
+
+// Ends the current task. Returning from a task's entry function does the same.
+void task_exit();
+
+// Marks a parked task as ready again.
+void task_wake(int taskid);
+
+// Parks the current task until *counter >= target. Tasks that change the counter wake the waiting one with task_wake()
+// afterwards. The task is parked before the counter is read, so a wake-up landing in between isn't lost.
+void task_wait_counter(int *counter, int target);
+
+/**
+ * Handles name one particular task, unlike ids, which are reused once the task exits.
+ * task_cancel() asks a task to stop: its current and future waits in task_wait_fd() (and the IO functions built on
+ * it) fail with ECANCELED, and a task parked any other way is woken so it can check task_is_cancelled().
+ * Returns false if the task already exited.
+ */
+uint64_t task_handle(int taskid);
+
+bool task_cancel(uint64_t handle);
+
+bool task_is_cancelled();
+
+/**
+ * Task-local storage: every key has one slot per task, initially NULL. When a task exits, the destructor of every key
+ * is called with the task's value, unless the value is NULL.
+ * task_local_new() returns the new key, or -1 once all TASK_LOCAL_SLOTS keys are taken.
+ */
+int task_local_new(void (*destructor)(void *));
+
+static inline void *task_local_get(int key) {
+    return current_task->locals[key];
+}
+
+static inline void task_local_set(int key, void *value) {
+    current_task->locals[key] = value;
+}
+
+// Sets up the sleep timer, then triggers a context switch to yield to another task.
+void sleep_for(float ms, const char *name);
+
+// Add the file descriptor to the watchlist of a task (taskid).
+// When that file descriptor has new notifications, we will set the ready_mask of that taskid,
+// and the task will wake up to read.
+void add_to_watchlist(int fd, int taskid);
+
+// A task has processed the event. Now, put it back to sleep, and call into scheduler.
+void clear_ready_mask();
+
+/**
+ * Parks the current task until epoll reports one of `events` on fd, or until timeout_ms passes (negative means no
+ * timeout). Returns 0 if the fd is ready, -ETIMEDOUT or -ECANCELED otherwise. A timed out or cancelled wait removes
+ * the fd from sch.epollfd.
+ * Deadlines are checked by the scheduler, so they are only as precise as the scheduler tick.
+ */
+int task_wait_fd(int fd, uint32_t events, long timeout_ms);
+
+int task_wait_readable(int fd, long timeout_ms);
+
+int task_wait_writable(int fd, long timeout_ms);
+
+/**
+ * Non-blocking IO for tasks. The file descriptors must be in O_NONBLOCK mode. When a call would block, the task
+ * parks until epoll reports the fd as ready, so other tasks run in the meantime.
+ * All of them return -1 and set errno on failure, like the syscalls they wrap. They never time out, but fail with
+ * ECANCELED once the task is cancelled.
+ */
+
+ssize_t task_read(int fd, void *buf, size_t len);
+
+// Writes all `len` bytes unless an error occurs.
+ssize_t task_write(int fd, const void *buf, size_t len);
+
+// Returns a new connection, itself in non-blocking mode.
+int task_accept(int listen_fd);
+
+int task_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+#endif //P1_RUNTIME_H
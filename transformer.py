@@ -1,18 +1,27 @@
 from pycparser import parse_file
-from pycparser import c_ast, c_generator
+from pycparser import c_ast, c_generator, c_parser
 import copy
+import sys
 
 from pycparser.c_ast import Decl, TypeDecl, IdentifierType, Struct, FileAST, Assignment, ID, StructRef, Constant, \
-    FuncCall, ExprList, UnaryOp, Cast, Return, Compound, PtrDecl, FuncDef, FuncDecl, ParamList
+    FuncCall, ExprList, UnaryOp, Cast, Return, Compound, PtrDecl, FuncDef, FuncDecl, ParamList, ArrayRef, ArrayDecl, \
+    Typedef
 
 text = str(open("gc.c", "r").read())
 
+# With --conservative, functions push no stack frames: the program relies on gc_set_conservative() to find its roots on
+# the C stack instead, and allocations of known types are typed so that the objects found there are traced precisely.
+conservative = "--conservative" in sys.argv[1:]
+# The transformed program is written to gc-1.c, or the path given after the options (the build writes its own copy).
+outputs = [arg for arg in sys.argv[1:] if arg != "--conservative"]
+output = outputs[0] if outputs else "gc-1.c"
+
 ast = parse_file("gc.c", use_cpp=True,
                  cpp_args=[
                      '-D__attribute__(x)=',
                      '-D__deprecated__(x)=',
-                     '-I../pycparser/utils/fake_libc_include', '-I/usr/include/glib-2.0',
-                     '-I/usr/lib/x86_64-linux-gnu/glib-2.0/include'])
+                     '-D__thread=',
+                     '-I../pycparser/utils/fake_libc_include'])
 
 files = set()
 
@@ -28,11 +37,23 @@ ast1 = list(ours(ast))[31:32]
 GCTYPES = {
     "ArrayType", "GCDouble", "GCInt", "GCPointer", "GCString", "ArrOfNested"}
 
+# GC values that are a pointer to an object without pointers.
+LEAFTYPES = {"GCDouble", "GCInt", "GCPointer", "GCString"}
+
 USERTYPES = {
     "Nested1",
 }
 
 
+# Fields of every struct and typedef'd struct, by name.
+STRUCT_FIELDS = {}
+for stmt in ast.ext:
+    if type(stmt) == Decl and type(stmt.type) == Struct and stmt.type.decls is not None:
+        STRUCT_FIELDS[stmt.type.name] = {d.name: d.type for d in stmt.type.decls}
+    if type(stmt) == Typedef and type(stmt.type.type) == Struct and stmt.type.type.decls is not None:
+        STRUCT_FIELDS[stmt.name] = {d.name: d.type for d in stmt.type.type.decls}
+
+
 def extract_name(elem):
     if type(elem.type) == PtrDecl:
         return extract_name(elem.type)
@@ -45,11 +66,20 @@ def extract_name(elem):
     raise RuntimeError
 
 
-def collect_gc_roots(stmt):
+def gc_locals(stmt):
+    """Names of the GC-typed locals declared at the top level of a function body."""
+    return {a.name for a in stmt.block_items or [] if type(a) == Decl and extract_name(a) in GCTYPES.union(USERTYPES)}
+
+
+def collect_gc_roots(stmt, spilled):
+    """
+    Takes the declarations of the locals in spilled out of a function body, to move them into its stack frame. An
+    initializer stays where its declaration was, as an assignment, since what runs before it may collect.
+    """
     res = []
     for index, a in enumerate(stmt.block_items):
-        if type(a) == Decl and extract_name(a) in GCTYPES.union(USERTYPES):
-            stmt.block_items[index] = None
+        if type(a) == Decl and a.name in spilled:
+            stmt.block_items[index] = Assignment('=', ID(a.name), a.init) if a.init is not None else None
             res.append(a)
 
     stmt.block_items = list(filter(lambda k: k is not None, stmt.block_items))
@@ -75,38 +105,496 @@ def change_local_vars(node, local_vars):
             change_local_vars(n, local_vars)
 
 
-def decl_name_type(name, type, struct=False, ptr=False):
-    return Decl(name, [], [], [], [], type_decl(name, type, struct, ptr), None, None)
+def value_type(node):
+    """(name, pointer depth) of a declared type, e.g. ("Nested1", 1) for struct Nested1 *. None for function pointers."""
+    depth = 0
+    while type(node) in (PtrDecl, ArrayDecl):
+        depth += 1
+        node = node.type
+    if type(node) != TypeDecl:
+        return None
+    if type(node.type) == Struct:
+        return node.type.name, depth
+    return node.type.names[-1], depth
+
+
+def expr_type(expr, env):
+    """value_type() of an lvalue made of variables, fields and array elements, or None."""
+    if type(expr) == ID:
+        return value_type(env[expr.name]) if expr.name in env else None
+    if type(expr) == StructRef:
+        parent = expr_type(expr.name, env)
+        depth = 0 if expr.type == '.' else 1
+        if parent is None or parent[1] != depth or parent[0] not in STRUCT_FIELDS:
+            return None
+        field = STRUCT_FIELDS[parent[0]].get(expr.field.name)
+        return value_type(field) if field is not None else None
+    if type(expr) == ArrayRef:
+        array = expr_type(expr.name, env)
+        return (array[0], array[1] - 1) if array is not None and array[1] > 0 else None
+    return None
+
+
+def is_gc_value(t):
+    return t is not None and t[1] == 0 and t[0] in GCTYPES.union(USERTYPES)
+
+
+def barrier_target(lvalue, env):
+    """
+    The value to give gc_write_barrier() after a store to lvalue, as (address expression, type name): the outermost
+    GC-typed value holding the slot that is in the same object. An array element stands for the ArrayType whose buffer
+    it's in, since marking an ArrayType traces the buffer.
+    None if the slot is in a variable, i.e. in a stack frame, which every collection traces anyway.
+    """
+    best = None
+    node = lvalue
+    while True:
+        if type(node) == StructRef and node.type == '.':
+            if is_gc_value(expr_type(node.name, env)):
+                best = node.name
+            node = node.name
+        elif type(node) == StructRef and node.type == '->':
+            pointee = expr_type(node.name, env)
+            if pointee is not None and is_gc_value((pointee[0], pointee[1] - 1)):
+                return node.name, pointee[0]
+            break
+        elif type(node) == ArrayRef and type(node.name) == StructRef and node.name.field.name == 'arr':
+            # Element of the buffer of an ArrayType.
+            buffer = node.name
+            if buffer.type == '->':
+                return buffer.name, 'ArrayType'
+            best = buffer.name
+            node = buffer.name
+        elif type(node) == ID:
+            return None
+        else:
+            break
+    if best is None:
+        raise RuntimeError(f"Can't find the GC object written to at {lvalue.coord}")
+    return UnaryOp('&', best), expr_type(best, env)[0]
+
 
+def function_env(fndef):
+    """Types of the parameters and locals of a function, by name."""
+    env = {}
+    params = fndef.decl.type.args.params if fndef.decl.type.args is not None else []
+    for decl in params:
+        if type(decl) == Decl:
+            env[decl.name] = decl.type
 
-def mark_command(varname, typename):
-    typename_str = extract_name(typename)
-    if type(typename.type) == PtrDecl:
-        arg = StructRef(ID("stc"), "->", ID(varname))
-        return Compound([FuncCall(ID(f"gc_mark_{typename_str}"), ExprList([arg, ID("table")])),
-                         FuncCall(ID(f"gc_mark_plain"), ExprList([arg, ID("table")]))])
-    else:
-        arg = UnaryOp('&', StructRef(ID("stc"), "->", ID(varname)))
-        return FuncCall(ID(f"gc_mark_{typename_str}"),
-                        ExprList([arg, ID("table")]))
+    def visit(node):
+        if type(node) == Decl:
+            env[node.name] = node.type
+
+    recurse(fndef.body, visit)
+    return env
+
+
+def insert_barriers(node, env):
+    """Follows every store of a pointer or GC value into a heap object with a gc_write_barrier_typed() call."""
+    for child in node:
+        insert_barriers(child, env)
+    if type(node) != Compound or node.block_items is None:
+        return
+    items = []
+    for stmt in node.block_items:
+        items.append(stmt)
+        if type(stmt) != Assignment:
+            continue
+        t = expr_type(stmt.lvalue, env)
+        if t is None or not (t[1] > 0 or is_gc_value(t)):
+            continue
+        target = barrier_target(stmt.lvalue, env)
+        if target is not None:
+            address, typename = target
+            items.append(FuncCall(ID("gc_write_barrier_typed"), ExprList(
+                [address, UnaryOp('&', ID(f"gc_type_{typename}"))])))
+    node.block_items = items
+
+
+# Runtime functions that may collect. Those of runtime.c that give up the CPU do too: with gc_use_task_stacks(), another
+# task may collect in the meantime.
+COLLECTING_RUNTIME = {"gc_malloc", "gc_array_reserve", "gc_array_push", "gc_array_splice", "gc_array_reserve_typed",
+                      "gc_array_push_typed", "gc_array_splice_typed", "gc_run", "gc_run_major", "gc_step", "task_yield",
+                      "sleep_for", "clear_ready_mask", "task_wait_fd", "task_wait_readable", "task_wait_writable",
+                      "task_read", "task_write", "task_accept", "task_connect"}
+
+
+def call_graph(ast):
+    """For every function defined in gc.c, the functions it calls by name, and whether it calls through a pointer."""
+    graph = {}
+    for stmt in ours(ast):
+        if type(stmt) != FuncDef:
+            continue
+        callees, indirect = set(), False
+
+        def visit(node):
+            nonlocal indirect
+            if type(node) == FuncCall:
+                if type(node.name) == ID:
+                    callees.add(node.name.name)
+                else:
+                    indirect = True
+
+        recurse(stmt.body, visit)
+        graph[stmt.decl.name] = callees, indirect
+    return graph
+
+
+def collecting_functions(graph):
+    """
+    The functions that may collect: the runtime's, and those that call one, or call through a pointer. Functions
+    defined elsewhere (the C library) are assumed not to call back into the program.
+    """
+    collecting = set(COLLECTING_RUNTIME)
+    changed = True
+    while changed:
+        changed = False
+        for name, (callees, indirect) in graph.items():
+            if name not in collecting and (indirect or callees & collecting):
+                collecting.add(name)
+                changed = True
+    return collecting
+
+
+class Unanalyzable(Exception):
+    pass
+
+
+class Liveness:
+    """
+    Backward liveness of the variables of a function, over its structured statements. It finds the variables live across
+    a safepoint, i.e. a call that may collect: those still used after the call, or by the statement making it. Only
+    those need a stack frame slot, where the collector sees (and compaction updates) them.
+    """
+
+    def __init__(self, collecting, env):
+        self.collecting = collecting
+        self.env = env
+        self.across = set()
+        self.address_taken = set()
+
+    def is_safepoint(self, node):
+        found = False
+
+        def visit(n):
+            nonlocal found
+            if type(n) == FuncCall:
+                # A call through a pointer, or a function pointer variable, may go anywhere.
+                if type(n.name) != ID or n.name.name in self.collecting or n.name.name in self.env:
+                    found = True
+
+        if node is not None:
+            recurse(node, visit)
+        return found
+
+    def uses(self, node):
+        """Variables an expression reads. The variable a plain assignment or declaration writes isn't read."""
+        used = set()
+
+        def visit(n):
+            if n is None:
+                return
+            if type(n) == ID:
+                used.add(n.name)
+            elif type(n) == StructRef:
+                visit(n.name)
+            elif type(n) == FuncCall:
+                if type(n.name) != ID:
+                    visit(n.name)
+                visit(n.args)
+            elif type(n) == Assignment and n.op == '=' and type(n.lvalue) == ID:
+                visit(n.rvalue)
+            elif type(n) == Decl:
+                visit(n.init)
+            else:
+                if type(n) == UnaryOp and n.op == '&':
+                    root = n.expr
+                    while type(root) in (StructRef, ArrayRef) and not (type(root) == StructRef and root.type == '->'):
+                        root = root.name
+                    if type(root) == ID:
+                        self.address_taken.add(root.name)
+                for child in n:
+                    visit(child)
+
+        visit(node)
+        return used
+
+    @staticmethod
+    def kills(node):
+        if type(node) == Assignment and node.op == '=' and type(node.lvalue) == ID:
+            return {node.lvalue.name}
+        if type(node) == Decl:
+            return {node.name}
+        return set()
+
+    def expression(self, node, after):
+        """Live variables before an expression (or simple statement), given those after it."""
+        if node is None:
+            return after
+        live = (after - self.kills(node)) | self.uses(node)
+        if self.is_safepoint(node):
+            self.across |= live
+        return live
+
+    def statement(self, node, after, loop):
+        """Live variables before a statement. loop is what's live after a break and after a continue."""
+        t = type(node)
+        if node is None:
+            return after
+        if t == Compound:
+            for item in reversed(node.block_items or []):
+                after = self.statement(item, after, loop)
+            return after
+        if t == c_ast.DeclList:
+            for decl in reversed(node.decls):
+                after = self.expression(decl, after)
+            return after
+        if t == c_ast.If:
+            branches = self.statement(node.iftrue, after, loop) | self.statement(node.iffalse, after, loop)
+            return self.expression(node.cond, branches)
+        if t == c_ast.TernaryOp:
+            return self.expression(node, after)
+        if t in (c_ast.While, c_ast.DoWhile, c_ast.For):
+            # Iterated to a fixed point: what's live at the top of the loop grows with every pass until it stops.
+            head = set()
+            while True:
+                if t == c_ast.While:
+                    body = self.statement(node.stmt, head, (after, head))
+                    new_head = self.expression(node.cond, after | body)
+                elif t == c_ast.DoWhile:
+                    cond = self.expression(node.cond, after | head)
+                    new_head = self.statement(node.stmt, cond, (after, cond))
+                else:
+                    step = self.expression(node.next, head)
+                    body = self.statement(node.stmt, step, (after, step))
+                    new_head = self.expression(node.cond, after | body)
+                if new_head == head:
+                    break
+                head = new_head
+            return self.statement(node.init, head, loop) if t == c_ast.For else head
+        if t == Return:
+            return self.expression(node.expr, set())
+        if t == c_ast.Break:
+            return loop[0]
+        if t == c_ast.Continue:
+            return loop[1]
+        if t in (c_ast.Switch, c_ast.Goto, c_ast.Label, c_ast.Case, c_ast.Default):
+            raise Unanalyzable
+        return self.expression(node, after)
+
+
+def spilled_locals(fndef, collecting, scratch):
+    """
+    The GC-typed locals of a function that must be in its stack frame: those live across a safepoint. None if it can't
+    collect. All of them if its control flow is beyond the analysis (switch, goto). Never those holding scratch objects,
+    which aren't in the GC heap.
+    """
+    candidates = gc_locals(fndef.body) - scratch
+    if fndef.decl.name not in collecting:
+        return set()
+    liveness = Liveness(collecting, function_env(fndef))
+    try:
+        liveness.statement(fndef.body, set(), (set(), set()))
+    except Unanalyzable:
+        return candidates
+    # A pointer to a variable may be used to read it after any safepoint.
+    return candidates & (liveness.across | liveness.address_taken)
+
+
+# C library functions that don't keep the pointers they're given. Those returning one of them only when their result
+# isn't used.
+NON_RETAINING_CALLS = {"printf", "fprintf", "sprintf", "snprintf", "puts", "fputs", "strlen", "strcmp", "strncmp",
+                       "memcmp", "atoi", "atol", "atof", "sscanf"}
+ARGUMENT_RETURNING_CALLS = {"strcpy", "strncpy", "strcat", "strncat", "memcpy", "memmove", "memset"}
+
+
+def allocation_functions(ast):
+    """
+    Functions returning a new zeroed GC object, and the index of their argument that is its size: gc_malloc(), and the
+    functions of gc.c that only return gc_malloc() of one of their parameters, like gc_string().
+    """
+    allocators = {"gc_malloc": 0}
+    for stmt in ours(ast):
+        if type(stmt) != FuncDef or stmt.body.block_items is None or len(stmt.body.block_items) != 1:
+            continue
+        ret = stmt.body.block_items[0]
+        call = ret.expr.expr if type(ret) == Return and type(ret.expr) == Cast else getattr(ret, 'expr', None)
+        params = [p.name for p in stmt.decl.type.args.params] if stmt.decl.type.args is not None else []
+        if type(ret) == Return and type(call) == FuncCall and type(call.name) == ID and call.name.name == "gc_malloc" \
+                and len(call.args.exprs) == 1 and type(call.args.exprs[0]) == ID and call.args.exprs[0].name in params:
+            allocators[stmt.decl.name] = params.index(call.args.exprs[0].name)
+    return allocators
+
+
+def is_null(expr):
+    if type(expr) == Cast:
+        expr = expr.expr
+    return type(expr) == Constant and expr.value == '0'
+
+
+def lvalue_root(expr):
+    """The variable an lvalue is in, or points into."""
+    while type(expr) in (StructRef, ArrayRef, UnaryOp):
+        expr = expr.expr if type(expr) == UnaryOp else expr.name
+    return expr.name if type(expr) == ID else None
+
+
+def stack_allocate(fndef, allocators):
+    """
+    Escape analysis: finds the locals of a function that only ever hold objects it allocates, which don't outlive it,
+    and moves their allocations to scratch storage (see struct GCScratch) freed when it returns. Such a variable is only
+    dereferenced, compared, or given to C library functions that don't keep it, and no pointer or GC value is stored
+    into its objects, which the collector wouldn't see. It's intraprocedural: passing the variable to another function
+    of the program, returning it (or anything read through it), or copying it anywhere makes its objects escape.
+    Returns the variables, and the cleanup to run before returning.
+    """
+    env = function_env(fndef)
+    declared = []
+    recurse(fndef.body, lambda n: declared.append(n.name) if type(n) == Decl else None)
+    candidates = set()
+    for name in declared:
+        t = value_type(env[name])
+        # Shadowed names are left alone.
+        if declared.count(name) == 1 and t is not None and (t[1] > 0 or t[0] in LEAFTYPES):
+            candidates.add(name)
+
+    escaping = set()
+    sites = []
+
+    def allocation(expr):
+        return type(expr) == FuncCall and type(expr.name) == ID and expr.name.name in allocators
+
+    def assigned(name, value):
+        if allocation(value):
+            sites.append((name, value))
+            walk(value.args)
+        elif not is_null(value):
+            escaping.add(name)
+            walk(value)
+
+    def walk(node, safe=False, statement=False):
+        """safe: a variable that is node itself doesn't escape there."""
+        t = type(node)
+        if node is None:
+            return
+        if t == ID:
+            if not safe:
+                escaping.add(node.name)
+        elif t == Return:
+            recurse(node, lambda n: escaping.add(n.name) if type(n) == ID else None)
+        elif t == StructRef:
+            walk(node.name, safe=node.type == '->')
+        elif t == ArrayRef:
+            walk(node.name, safe=True)
+            walk(node.subscript)
+        elif t == UnaryOp:
+            walk(node.expr, safe=node.op in ('*', '!', 'sizeof'))
+        elif t == c_ast.BinaryOp and node.op in ('==', '!='):
+            walk(node.left, safe=True)
+            walk(node.right, safe=True)
+        elif t == Cast:
+            walk(node.expr, safe)
+        elif t == FuncCall:
+            name = node.name.name if type(node.name) == ID else None
+            keeps = name not in NON_RETAINING_CALLS and not (statement and name in ARGUMENT_RETURNING_CALLS)
+            if type(node.name) != ID:
+                walk(node.name)
+            for arg in node.args.exprs if node.args is not None else []:
+                walk(arg, safe=not keeps)
+        elif t == Assignment and node.op == '=' and type(node.lvalue) == ID:
+            assigned(node.lvalue.name, node.rvalue)
+        elif t == Assignment:
+            stored = expr_type(node.lvalue, env)
+            if stored is None or stored[1] > 0 or is_gc_value(stored):
+                escaping.add(lvalue_root(node.lvalue))
+            walk(node.lvalue, safe=True)
+            walk(node.rvalue)
+        elif t == Decl:
+            if node.init is not None:
+                assigned(node.name, node.init)
+        elif t in (c_ast.If, c_ast.While, c_ast.DoWhile):
+            walk(node.cond, safe=True)
+            for child in (node.iftrue, node.iffalse) if t == c_ast.If else (node.stmt,):
+                walk(child, statement=True)
+        elif t == c_ast.For:
+            walk(node.init, statement=True)
+            walk(node.cond, safe=True)
+            walk(node.next, statement=True)
+            walk(node.stmt, statement=True)
+        elif t == Compound:
+            for item in node.block_items or []:
+                walk(item, statement=True)
+        else:
+            for child in node:
+                walk(child)
+
+    walk(fndef.body)
+    scratch = candidates - escaping
+    prologue, cleanup = [], []
+    for index, (name, call) in enumerate([site for site in sites if site[0] in scratch]):
+        storage = f"gc_scratch_{index}"
+        size = call.args.exprs[allocators[call.name.name]]
+        call.name = ID("gc_scratch_alloc")
+        call.args = ExprList([UnaryOp('&', ID(storage)), size])
+        prologue += c_parser.CParser().parse(
+            f"void f() {{ struct GCScratch {storage}; gc_scratch_init(&{storage}); }}").ext[0].body.block_items
+        cleanup.append(FuncCall(ID("gc_scratch_free"), ExprList([UnaryOp('&', ID(storage))])))
+    fndef.body.block_items = prologue + (fndef.body.block_items or [])
+    return scratch, cleanup
 
 
 def generate_decl(name, type):
     return Decl(name, [], [], [], [], type, None, None)
 
 
-def mark_func_decl(struct):
-    fn_name = f"gc_mark_{struct.name}"
-    body = Compound([mark_command(decl.name, decl) for decl in struct if decl.name != "id"])
+def describe_field(decl):
+    """
+    Where a field goes in its struct's GCType, as (table, type name of what it holds): a pointer to a GC object,
+    an ArrayType or an embedded struct. The type name is None for objects without pointers. None if the field holds no
+    GC values.
+    """
+    t = value_type(decl.type)
+    if t is None or t[0] not in GCTYPES.union(USERTYPES):
+        return None
+    name, depth = t
+    if depth == 0 and name in LEAFTYPES:
+        return "pointers", None
+    if depth == 0 and name == "ArrayType":
+        return "arrays", None
+    if depth == 0:
+        return "structs", name
+    if depth == 1:
+        return "pointers", name
+    raise RuntimeError(f"Can't describe {decl.name} at {decl.coord}: pointers to pointers to GC values aren't traced")
+
+
+def type_descriptor(struct):
+    """
+    The GCType of a struct, gc_type_<name>, with the field tables it points to: what gc_mark_typed() interprets, instead
+    of a marking function per struct. Pointers are updated through their field, so compaction can move what they point
+    to.
+    """
+    tables = {"pointers": [], "arrays": [], "structs": []}
+    for decl in struct.decls:
+        described = describe_field(decl)
+        if described is not None:
+            table, typename = described
+            target = f"&gc_type_{typename}" if typename is not None else "NULL"
+            tables[table].append(f"{{offsetof(struct {struct.name}, {decl.name}), {target}}}")
+
+    code = ""
+    fields = [f".size = sizeof(struct {struct.name})"]
+    for table, entries in tables.items():
+        if entries:
+            code += f"static const struct GCField gc_{table}_{struct.name}[] = {{{', '.join(entries)}}};\n"
+            fields.append(f".{table[:-1]}_count = {len(entries)}, .{table} = gc_{table}_{struct.name}")
+    code += f"const struct GCType gc_type_{struct.name} = {{{', '.join(fields)}}};\n"
+    return c_parser.CParser().parse(code).ext
 
-    if_stmt = c_ast.If(c_ast.BinaryOp('!=', ID('stc'), Constant('int', 'NULL')), body, None)
-    if_stmt_cmpd = Compound([if_stmt])
-    fndef = FuncDef(
-        generate_decl(fn_name, FuncDecl(ParamList([decl_name_type("stc", struct.name, True, True),
-                                                   decl_name_type("table", "GHashTable", False, True)]),
-                                        type_decl(fn_name, 'void')))
-        , None, body=if_stmt_cmpd)
-    return fndef
+
+def type_forward_decl(name):
+    return c_parser.CParser().parse(f"extern const struct GCType gc_type_{name};").ext[0]
 
 
 def type_decl(name, type, struct=False, ptr=False):
@@ -120,22 +608,20 @@ def type_decl(name, type, struct=False, ptr=False):
 pop_stack_call = FuncCall(ID("gc_pop_stack_frame"), ExprList([]))
 
 
-def generate_pop_frames(fndef):
+def generate_cleanup(fndef, cleanup):
+    """Runs cleanup (popping the stack frame, freeing scratch storage) before every return."""
     for index, stmt in enumerate(fndef):
         if type(stmt) == Return:
-            compound = Compound([
-                pop_stack_call,
-                stmt
-            ])
+            compound = Compound(cleanup + [stmt])
             if type(fndef) == Compound:
                 fndef.block_items[index] = compound
             else:
                 raise RuntimeError
         else:
-            generate_pop_frames(stmt)
+            generate_cleanup(stmt, cleanup)
 
     if type(fndef) == FuncDef:
-        fndef.body.block_items.append(pop_stack_call)
+        fndef.body.block_items.extend(cleanup)
 
 
 def generate_stack_struct(local, struct_name):
@@ -147,7 +633,7 @@ def generate_stack_struct(local, struct_name):
     return struct
 
 
-def get_init_list(local, stack_id):
+def get_init_list(stack_id):
     inits = [
         FuncCall(ID("memset"), ExprList(
             [UnaryOp("&", ID("stack_frame")), Constant(ID("int"), '0'), UnaryOp("sizeof", ID("stack_frame"))])),
@@ -158,16 +644,6 @@ def get_init_list(local, stack_id):
         ), FuncCall(ID("gc_push_stack_frame"), ExprList([
             Cast(type_decl(None, 'void', False, True), UnaryOp('&', ID('stack_frame')))
         ]))]
-    for a in local:
-        if hasattr(a, 'init') and a.init is not None:
-            inits.append(
-                Assignment(
-                    '=',
-                    StructRef(ID('stack_frame'), '.', ID(a.name)),
-                    a.init
-                )
-            )
-
     return inits
 
 
@@ -178,73 +654,222 @@ def generate_forward_decls(decl):
         copied = copy.copy(decl)
         copied.decls = None
         return copied
+    if type(decl) == Decl and decl.name.startswith("gc_type_"):
+        return type_forward_decl(decl.name[len("gc_type_"):])
 
 
 def generate_global_stack_map(map):
     global_res = c_ast.InitList([])
-    for this_id, fn_name in map.items():
-        this_frame = c_ast.InitList([Constant('int', str(this_id)), ID(fn_name)])
+    for this_id, struct_name in map.items():
+        this_frame = c_ast.InitList([Constant('int', str(this_id)), ID("NULL"),
+                                     UnaryOp('&', ID(f"gc_type_{struct_name}"))])
         global_res.exprs.append(this_frame)
 
-        decl = generate_decl('STACK_MAP', c_ast.ArrayDecl(type_decl('STACK_MAP', 'StackMap', struct=True), None, []))
-        decl.init = global_res
+    decl = generate_decl('STACK_MAP', c_ast.ArrayDecl(type_decl('STACK_MAP', 'StackMap', struct=True), None, []))
+    decl.init = global_res
     return decl
 
 
+def typed_structs(ast):
+    """Structs with a type descriptor: the user types, and those gc.c gives a gc_type_<name> itself."""
+    names = set(USERTYPES)
+    for stmt in ours(ast):
+        if type(stmt) == Decl and stmt.name is not None and stmt.name.startswith("gc_type_"):
+            names.add(stmt.name[len("gc_type_"):])
+    return names
+
+
+def type_allocations(node, structs):
+    """
+    Makes gc_malloc(sizeof(struct X)) gc_malloc_typed(sizeof(struct X), &gc_type_X) for structs with a descriptor, and
+    allocations cast to a GC value without pointers (like a GCString) typed as &gc_type_NoPointers.
+    """
+    def typed(call, type_name):
+        call.name = ID("gc_malloc_typed")
+        call.args.exprs.append(UnaryOp('&', ID(f"gc_type_{type_name}")))
+
+    def is_allocation(expr):
+        return type(expr) == FuncCall and type(expr.name) == ID and expr.name.name == "gc_malloc"
+
+    for child in node:
+        type_allocations(child, structs)
+    if type(node) == Cast and is_allocation(node.expr) and value_type(node.to_type.type) in \
+            {(name, 0) for name in LEAFTYPES}:
+        typed(node.expr, "NoPointers")
+    elif is_allocation(node) and len(node.args.exprs) == 1:
+        size = node.args.exprs[0]
+        if type(size) == UnaryOp and size.op == "sizeof" and type(size.expr) == c_ast.Typename:
+            t = size.expr.type
+            if type(t) == TypeDecl and type(t.type) == Struct and t.type.name in structs:
+                typed(node, t.type.name)
+
+
+def site_type(call, stmt, fndef, env):
+    """
+    What an allocation allocates, for the heap profile: the struct it's the size of, else what it's cast to, else what
+    the allocator it calls returns (unless it's gc_malloc()), else the type of what it's stored in or returned as. "?"
+    if it's none of those.
+    """
+    structs = []
+    recurse(call.args, lambda n: structs.append(n.expr.type.type.name) if type(n) == UnaryOp and n.op == "sizeof"
+            and type(n.expr) == c_ast.Typename and type(n.expr.type) == TypeDecl and type(n.expr.type.type) == Struct
+            else None)
+    if structs:
+        return structs[0]
+    value = stmt.init if type(stmt) == Decl else stmt.rvalue if type(stmt) == Assignment else \
+        stmt.expr if type(stmt) == Return else None
+    wrapper = next((f for f in ours(ast) if type(f) == FuncDef and f.decl.name == call.name.name), None)
+    if type(value) == Cast and value.expr is call:
+        t = value_type(value.to_type.type)
+    elif wrapper is not None:
+        t = value_type(wrapper.decl.type.type)
+    elif value is not call:
+        return "?"
+    elif type(stmt) == Decl:
+        t = value_type(stmt.type)
+    elif type(stmt) == Return:
+        t = value_type(fndef.decl.type.type)
+    else:
+        lvalue = stmt.lvalue
+        # The buffer of an ArrayType.
+        if type(lvalue) == StructRef and lvalue.field.name == "arr" and \
+                expr_type(lvalue.name, env) == ("ArrayType", 0 if lvalue.type == '.' else 1):
+            return "ArrayType"
+        t = expr_type(lvalue, env)
+    if t is None:
+        return "?"
+    name, depth = t
+    if depth == 0 or (depth == 1 and name in STRUCT_FIELDS):
+        return name
+    return name + " " + "*" * depth
+
+
+def tag_allocation_sites(node, fndef, env, allocators, sites):
+    """
+    Sets gc_site before every statement with one allocation, to a new entry of sites: (function, line, type). Bodies of
+    loops and ifs that allocate become blocks, so there's room for it.
+    """
+    def allocations(stmt):
+        calls = []
+        recurse(stmt, lambda n: calls.append(n) if type(n) == FuncCall and type(n.name) == ID
+                and n.name.name in allocators else None)
+        return calls
+
+    if type(node) != Compound:
+        for name, child in node.children():
+            if type(child) in (Compound, Decl, Assignment, FuncCall, Return) and name in ("iftrue", "iffalse", "stmt"):
+                if type(child) != Compound and allocations(child):
+                    child = Compound([child])
+                    setattr(node, name, child)
+            if type(child) not in (Decl, Assignment, FuncCall, Return):
+                tag_allocation_sites(child, fndef, env, allocators, sites)
+        return
+    items = []
+    for stmt in node.block_items or []:
+        calls = allocations(stmt) if type(stmt) in (Decl, Assignment, FuncCall, Return) else []
+        if len(calls) == 1:
+            sites.append((fndef.decl.name, calls[0].coord.line, site_type(calls[0], stmt, fndef, env)))
+            items.append(Assignment('=', ID("gc_site"), UnaryOp('&', ArrayRef(ID("gc_sites"),
+                                                                           Constant('int', str(len(sites) - 1))))))
+        elif type(stmt) not in (Decl, Assignment, FuncCall, Return):
+            tag_allocation_sites(stmt, fndef, env, allocators, sites)
+        items.append(stmt)
+    node.block_items = items
+
+
+def generate_sites(sites):
+    """static const struct GCSite gc_sites[] = {{"function", "gc.c", line, "type"}, ...};"""
+    init = c_ast.InitList([c_ast.InitList([Constant('string', f'"{function}"'), Constant('string', '"gc.c"'),
+                                           Constant('int', str(line)), Constant('string', f'"{site_type}"')])
+                           for function, line, site_type in sites])
+    array = c_ast.ArrayDecl(TypeDecl('gc_sites', ['const'], None, Struct('GCSite', None)), None, [])
+    return Decl('gc_sites', ['const'], [], ['static'], [], array, init, None)
+
+
+def transformed(stmt):
+    return type(stmt) == FuncDef and not stmt.decl.name.startswith("gc") and stmt.coord.file == "gc.c"
+
+
 stack_id = -1
 stack_map = {}
 
+# Allocations moved to scratch storage don't collect, so the call graph is built after.
+allocators = allocation_functions(ast)
+scratch = {}
+for stmt in filter(transformed, ours(ast)):
+    insert_barriers(stmt.body, function_env(stmt))
+    scratch[stmt.decl.name] = stack_allocate(stmt, allocators)
+# The allocators only pass their caller's site on.
+sites = []
+for stmt in ours(ast):
+    if type(stmt) == FuncDef and stmt.decl.name not in allocators:
+        tag_allocation_sites(stmt.body, stmt, function_env(stmt), allocators, sites)
+collecting = collecting_functions(call_graph(ast))
+if conservative:
+    structs = typed_structs(ast)
+    for stmt in ours(ast):
+        if type(stmt) == FuncDef and not stmt.decl.name.startswith("gc_malloc"):
+            type_allocations(stmt.body, structs)
+        if type(stmt) == FuncDef and stmt.decl.name == "main":
+            stmt.body.block_items.insert(0, FuncCall(ID("gc_set_conservative"), ExprList([ID("true")])))
+
 push_list = []
 for stmt in ours(ast):
     if type(stmt) == Decl and type(stmt.type) == Struct and extract_name(stmt) in USERTYPES:
-        result = mark_func_decl(stmt.type)
-        push_list.extend([result])
-    if type(stmt) == FuncDef:
-        if stmt.decl.name.startswith("gc") or stmt.coord.file != "gc.c":
+        push_list.extend(type_descriptor(stmt.type))
+    if transformed(stmt):
+        scratch_locals, cleanup = scratch[stmt.decl.name]
+        # Functions that can't collect, and locals not live across a safepoint, need no stack frame.
+        spilled = set() if conservative else spilled_locals(stmt, collecting, scratch_locals)
+        func_locals = collect_gc_roots(stmt.body, spilled)
+        if not func_locals:
+            if cleanup:
+                generate_cleanup(stmt, cleanup)
             continue
 
         stack_id += 1
-        func_locals = collect_gc_roots(stmt.body)
 
         local_names = [a.name for a in func_locals]
 
         struct_name = f"StackFrame_{stmt.decl.name}"
-        mark_name = f"gc_mark_{struct_name}"
         stck_declaration = Decl('stack_frame', [], [], [], [],
                                 type=type_decl('stack_frame', struct_name, True),
                                 init=None,
                                 bitsize=None)
-        inits = get_init_list(func_locals, stack_id)
+        inits = get_init_list(stack_id)
         stmt.body.block_items = [stck_declaration] + inits + stmt.body.block_items
 
         local_struct = generate_stack_struct(func_locals, struct_name)
 
-        mark_func = mark_func_decl(local_struct)
-        stack_map[stack_id] = mark_func.decl.name
+        stack_map[stack_id] = struct_name
 
-        generate_pop_frames(stmt)
+        generate_cleanup(stmt, [pop_stack_call] + cleanup)
         change_local_vars(stmt, local_names)
-        push_list.extend([local_struct, mark_func])
+        push_list.extend([local_struct] + type_descriptor(local_struct))
 
-forwards = list(map(generate_forward_decls, push_list))
+forwards = [forward for forward in map(generate_forward_decls, push_list) if forward is not None]
 stack_map_code = generate_global_stack_map(stack_map)
 ast.ext = list(filter(lambda k: k.coord.file == "gc.c", ast.ext))
 
 for index, stmt in enumerate(ast.ext):
     if getattr(stmt, "name", None) == "END_CODE_HERE":
-        ast.ext[index:index] = forwards + push_list
+        ast.ext[index:index] = forwards + push_list + ([generate_sites(sites)] if sites else [])
         break
 
 ast.ext.append(stack_map_code)
-file = open("gc-1.c", "w+")
+file = open(output, "w+")
 file.write("""
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
-#include <glib.h>
+#include <math.h>
+#include <time.h>
 #include <assert.h>
+
+#include "gc_runtime.h"
+
 """)
 file.write(c_generator.CGenerator().visit(ast))
 